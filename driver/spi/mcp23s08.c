@@ -11,6 +11,13 @@
 #define DIR_REG					0x00
 #define DATA_REG				0x09
 #define GPPU_REG				0x06
+#define IOCON_REG				0x05
+
+#define OLAT_REG				0x0A
+#define REG_COUNT				11
+
+#define IOCON_HAEN				0x08
+#define IOCON_SEQOP				0x20
 
 #define ALL_OUTPUTS				0x00
 #define ALL_INPUTS				0xFF
@@ -18,6 +25,11 @@
 #define RED_LED_MASK			0x01
 #define GREEN_LED_MASK			0x02
 
+// A1/A0 strapping, chip select and SPI mode of the expander being talked to
+uint8_t hwAddress = 0;
+uint8_t expanderCs = 0;
+uint8_t expanderMode = 0;
+
 void initSpi(uint32_t control)
 {
 	// Set a baud rate of 5 MHz
@@ -36,42 +48,78 @@ void initSpi(uint32_t control)
 	enableSpi();
 }
 
+// Every access is one locked transaction that sets the expander's chip
+// select, mode and word size before its words, so another process cannot
+// retarget the core in between
+void transferMcp23s08(const uint32_t* tx, uint32_t* rx, uint32_t n, uint8_t wordSize, bool csAuto)
+{
+	spiSegment segment = { expanderCs, expanderMode, wordSize, csAuto, tx, rx, n };
+	spiTransferSegments(&segment, 1);
+}
+
 // This function makes use of auto CS
 void writeRegisterMcp23s08(uint8_t address, uint8_t data)
 {
-	uint32_t tmp = MCP23S08_ADDRESS;
+	uint32_t tmp = MCP23S08_ADDRESS | (hwAddress << 1);
 	tmp = (tmp << 8) | address;
 	tmp = (tmp << 8) | data;
-	spiWriteData(tmp);
-	while (!(spiReadRegister(OFS_STATUS) & 0x20));
-	spiReadData();
+	transferMcp23s08(&tmp, NULL, 1, 24, true);
 }
 
 uint32_t readRegisterMcp23s08(uint8_t address)
 {
-	uint32_t tmp = MCP23S08_ADDRESS | 1;
+	uint32_t tmp = MCP23S08_ADDRESS | (hwAddress << 1) | 1;
 	tmp = (tmp << 8) | address;
 	tmp = (tmp << 8) | 0xFF;
-	spiWriteData(tmp);
-	while (!(spiReadRegister(OFS_STATUS) & 0x20));
-	return spiReadData();
+	transferMcp23s08(&tmp, &tmp, 1, 24, true);
+	return tmp;
 }
 
-void writeRegisterMcp23s08CsMan(uint8_t address, uint8_t data, uint8_t cs)
+void writeRegisterMcp23s08CsMan(uint8_t address, uint8_t data)
 {
-	uint32_t tmp = MCP23S08_ADDRESS;
+	uint32_t tmp = MCP23S08_ADDRESS | (hwAddress << 1);
 	tmp = (tmp << 8) | address;
 	tmp = (tmp << 8) | data;
-	disableCS(cs);
-	spiWriteData(tmp);
-	while (!(spiReadRegister(OFS_STATUS) & 0x20));
-	spiReadData();
-	enableCS(cs);
+	transferMcp23s08(&tmp, NULL, 1, 24, false);
+}
+
+// Reads or writes all registers in one frame. The expander increments the
+// register address after every byte while IOCON.SEQOP is clear (the default),
+// so CS is held low over opcode, register 0 and the 11 registers sent as
+// 8-bit words.
+void transferRegistersMcp23s08Seq(bool read, uint8_t* regs)
+{
+	uint32_t tx[2 + REG_COUNT];
+	uint32_t rx[2 + REG_COUNT];
+	uint8_t i;
+	tx[0] = MCP23S08_ADDRESS | (hwAddress << 1) | (read ? 1 : 0);
+	tx[1] = 0x00;
+	for (i = 0; i < REG_COUNT; i++)
+		tx[2 + i] = read ? 0xFF : regs[i];
+	transferMcp23s08(tx, rx, 2 + REG_COUNT, 8, false);
+	if (read)
+		for (i = 0; i < REG_COUNT; i++)
+			regs[i] = rx[2 + i];
+}
+
+// Until HAEN is set every expander on the chip select answers to address 0,
+// so this write reaches all of them
+void enableHardwareAddress(bool csManual)
+{
+	uint8_t address = hwAddress;
+	hwAddress = 0;
+	if (csManual)
+		writeRegisterMcp23s08CsMan(IOCON_REG, IOCON_HAEN);
+	else
+		writeRegisterMcp23s08(IOCON_REG, IOCON_HAEN);
+	hwAddress = address;
 }
 
 void help(const char* programName)
 {
+	printf("%s cs_auto|cs_man on|off [pins] [cs] [mode] [address]\n", programName);
 	printf("%s stop_go [mode]\n", programName);
+	printf("%s regs [cs [address]] [11 hex register values to write]\n", programName);
 }
 
 int main(int argc, char* argv[])
@@ -90,6 +138,12 @@ int main(int argc, char* argv[])
 	else
 		printf("Mapped physical memory 0x%8x with %d bytes of span!\n", LW_BRIDGE_BASE + SPI_BASE_OFFSET, SPAN_IN_BYTES);
 
+	if (argc == 7 && (strcmp(argv[1], "cs_auto") == 0 || strcmp(argv[1], "cs_man") == 0))
+	{
+		hwAddress = atoi(argv[6]) & 0x03;
+		argc--;
+	}
+
 	if (argc == 6 && strcmp(argv[1], "cs_auto") == 0)
 	{
 		initSpi(CS0_AUTO | CS1_AUTO | CS2_AUTO | CS3_AUTO | WORD_SIZE_24BITS);
@@ -101,9 +155,11 @@ int main(int argc, char* argv[])
 		if (mode > 3)
 			mode = 0;
 
-		csSelect(cs);
-		spiSetMode(cs, mode);
+		expanderCs = cs;
+		expanderMode = mode;
 
+		if (hwAddress != 0)
+			enableHardwareAddress(false);
 		writeRegisterMcp23s08(DIR_REG, ALL_OUTPUTS);
 
 		if (strcmp(argv[2], "on") == 0)
@@ -129,18 +185,20 @@ int main(int argc, char* argv[])
 		if (mode > 3)
 			mode = 0;
 
-		csSelect(cs);
-		spiSetMode(cs, mode);
+		expanderCs = cs;
+		expanderMode = mode;
 		
-		writeRegisterMcp23s08CsMan(DIR_REG, ALL_OUTPUTS, cs);
+		if (hwAddress != 0)
+			enableHardwareAddress(true);
+		writeRegisterMcp23s08CsMan(DIR_REG, ALL_OUTPUTS);
 
 		if(strcmp(argv[2], "on") == 0)
 		{
-			writeRegisterMcp23s08CsMan(DATA_REG, strtol(argv[3], NULL, 16) & 0xFF, cs);
+			writeRegisterMcp23s08CsMan(DATA_REG, strtol(argv[3], NULL, 16) & 0xFF);
 		}
 		else if(strcmp(argv[2], "off") == 0)
 		{
-			writeRegisterMcp23s08CsMan(DATA_REG, 0x00, cs);
+			writeRegisterMcp23s08CsMan(DATA_REG, 0x00);
 		}
 	}
 
@@ -152,8 +210,8 @@ int main(int argc, char* argv[])
 		mode = (mode > 3) ? 0 : mode;
 		printf("Running in mode %hhu, %hhu\n", (mode >> 1) & 1, mode & 1);
 
-		csSelect(0);
-		spiSetMode(0, mode);
+		expanderCs = 0;
+		expanderMode = mode;
 		// Set pins 0 and 1 as outputs and the rest as inputs
 		// 0 represents an output and 1 an input
 		writeRegisterMcp23s08(GPPU_REG, 0xFF);
@@ -164,6 +222,39 @@ int main(int argc, char* argv[])
 		writeRegisterMcp23s08(DATA_REG, 0x02);
 	}
 
+	if (argc >= 2 && strcmp(argv[1], "regs") == 0)
+	{
+		initSpi(WORD_SIZE_8BITS);
+
+		uint32_t cs = (argc >= 3) ? atoi(argv[2]) : 0;
+		if (cs > 3)
+			cs = 0;
+		expanderCs = cs;
+
+		// The address is only there when the argument count says so
+		int values = (argc == 4 || argc == 4 + REG_COUNT) ? 4 : 3;
+		if (values == 4)
+			hwAddress = atoi(argv[3]) & 0x03;
+
+		uint8_t regs[REG_COUNT];
+		uint8_t i;
+		if (argc == values + REG_COUNT)
+		{
+			uint8_t current[REG_COUNT];
+			transferRegistersMcp23s08Seq(true, current);
+			for (i = 0; i < REG_COUNT; i++)
+				regs[i] = strtol(argv[values + i], NULL, 16) & 0xFF;
+			// IOCON must keep SEQOP clear and the current addressing mode,
+			// a GPIO write lands in OLAT
+			regs[IOCON_REG] = (regs[IOCON_REG] & ~(IOCON_SEQOP | IOCON_HAEN)) | (current[IOCON_REG] & IOCON_HAEN);
+			regs[DATA_REG] = regs[OLAT_REG];
+			transferRegistersMcp23s08Seq(false, regs);
+		}
+		transferRegistersMcp23s08Seq(true, regs);
+		for (i = 0; i < REG_COUNT; i++)
+			printf("%02hhx%c", regs[i], (i + 1 == REG_COUNT) ? '\n' : ' ');
+	}
+
 	disableSpi();
 	return EXIT_SUCCESS;
 }
@@ -14,7 +14,13 @@
 // HPS interface:
 //   Mapped to offset of 0x8000 in light-weight MM interface aperature
 
+// The core is the SPI IP instance described in the device tree, see
+// spi_driver.c. This driver takes the place of spi_driver on that node.
+
 // Load kernel module with insmod spi_driver.ko [param=___]
+// Several expanders are listed as cs:address pairs, where address is the
+// A1/A0 strapping of the chip, e.g.
+//   insmod mcp23s08_driver.ko expanders=0:0,0:1,1:0 int_gpio=-1,-1,3
 
 //-----------------------------------------------------------------------------
 
@@ -23,9 +29,30 @@
 #include <linux/init.h>       // __init
 #include <linux/kobject.h>    // kobject, kobject_atribute,
 							  // kobject_create_and_add, kobject_put
-#include <asm/io.h>           // iowrite, ioread, ioremap_nocache (platform specific)
+#include <linux/ktime.h>      // ktime_get_ns
+#include <linux/debugfs.h>    // debugfs_create_dir, debugfs_create_file
+#include <linux/spinlock.h>   // DEFINE_SPINLOCK
+#include <linux/fs.h>         // file_operations
+#include <linux/miscdevice.h> // misc_register, misc_deregister
+#include <linux/uaccess.h>    // get_user, put_user
+#include <linux/gpio/driver.h> // gpio_chip, gpiochip_add_data
+#include <linux/gpio.h>       // gpio_request_one, gpio_to_irq
+#include <linux/interrupt.h>  // request_threaded_irq, handle_nested_irq
+#include <linux/irq.h>        // irq_chip, irqd_to_hwirq
+#include <linux/mutex.h>      // mutex_init, DEFINE_MUTEX
+#include <linux/slab.h>       // kstrndup, kfree
+#include <linux/string.h>     // strsep
+#include <linux/hrtimer.h>    // hrtimer playback, PWM and capture
+#include <linux/kfifo.h>      // capture buffer
+#include <linux/wait.h>       // wait_event_interruptible
+#include <linux/poll.h>       // poll_wait
+#include <linux/platform_device.h> // platform_driver, devm_platform_ioremap_resource
+#include <asm/io.h>           // iowrite, ioread (platform specific)
 #include "spi_regs.h"         // register offsets in SPI IP
-#include "../address_map.h"   // overall memory map
+#include "spi_stats.h"        // latency histograms shown in debugfs
+#define CREATE_TRACE_POINTS
+#include "mcp23s08_trace.h"   // mcp23s08 tracepoints
+#include "mcp23s08_ioctl.h"   // ioctls of /dev/spi_expander
 
 #define CS0_OFFSET				0x200
 #define CS_SELECT_OFFSET		0x00D
@@ -36,8 +63,43 @@
 
 #define MCP23S08_ADDRESS		0x40
 #define DIR_REG					0x00
-#define DATA_REG				0x09
+#define IPOL_REG				0x01
+#define GPINTEN_REG				0x02
+#define DEFVAL_REG				0x03
+#define INTCON_REG				0x04
+#define IOCON_REG				0x05
 #define GPPU_REG				0x06
+#define INTF_REG				0x07
+#define INTCAP_REG				0x08
+#define DATA_REG				0x09
+#define OLAT_REG				0x0A
+#define REG_COUNT				11
+
+#define IOCON_HAEN				0x08
+#define IOCON_SEQOP				0x20
+
+// Opcode, register and every register, in 8-bit words
+#define SEQ_FRAME_WORDS			(2 + REG_COUNT)
+
+// Shortest PWM high or low time, and how close edges of different pins must
+// be to share one OLAT write
+#define PWM_MIN_NS				10000
+#define PWM_COALESCE_NS			1000
+
+// Clock of the SPI IP, and the cycles it spends in IDLE and CS_ASSERT between words
+#define CLOCK_FREQUENCY			50000000
+#define WORD_GAP_CYCLES			3
+
+// Capture may keep the bus busy at most 1/CAPTURE_MAX_LOAD of the time
+#define CAPTURE_MAX_LOAD		2
+
+// Registers changed by the pins themselves, these are never cached
+#define VOLATILE_REGS			((1 << INTF_REG) | (1 << INTCAP_REG) | (1 << DATA_REG))
+
+// Up to 4 expanders share a chip select, told apart by their A1/A0 pins
+#define CS_COUNT				4
+#define ADDRESSES_PER_CS		4
+#define MAX_DEVICES				(CS_COUNT * ADDRESSES_PER_CS)
 
 //-----------------------------------------------------------------------------
 // Kernel module information
@@ -53,6 +115,115 @@ MODULE_DESCRIPTION("MCP23S08 IP Driver");
 
 static unsigned int* base = NULL;
 
+// Latency histograms and throughput per chip select, in /sys/kernel/debug/spi_expander/cs<k>
+static struct spiStats stats[CS_COUNT];
+static struct dentry* debugfsDir = NULL;
+
+struct mcp23s08PlayStep
+{
+	uint32_t word;
+	u64 delayNs;
+};
+
+struct mcp23s08Device
+{
+	uint8_t cs;
+	uint8_t address;
+	// Device 0 is /sys/kernel/spi_expander, device i is spi_expander<i>
+	char name[16];
+	char label[16];
+
+	// Last value written to or read from each non-volatile register
+	uint8_t regCache[REG_COUNT];
+	uint16_t regCacheValid;
+
+	// Interrupt on change
+	// Pins with their interrupt unmasked and the edges they trigger on.
+	// Level triggered pins compare against DEFVAL instead of the previous value.
+	int intGpio;
+	int intIrq;
+	uint8_t irqEnabled;
+	uint8_t irqRise;
+	uint8_t irqFall;
+	uint8_t irqIntcon;
+	uint8_t irqDefval;
+	struct mutex irqLock;
+
+	// Pattern playback, the words are OLAT writes encoded up front
+	struct hrtimer playTimer;
+	struct mcp23s08PlayStep* playSteps;
+	u64 playDueNs;
+	unsigned int playCount;
+	unsigned int playIndex;
+	unsigned int playLoops;
+	struct mutex playLock;
+
+	// Software PWM, pwmNext is the time of each enabled pin's next edge and
+	// pwmLevel the level it has until then
+	struct hrtimer pwmTimer;
+	u64 pwmPeriodNs[8];
+	u64 pwmDutyNs[8];
+	u64 pwmNext[8];
+	u64 pwmEpoch;
+	uint8_t pwmEnabled;
+	uint8_t pwmLevel;
+	struct mutex pwmLock;
+
+	// Input capture, captureTimer fills captureFifo which is read from the
+	// misc device. Samples that do not fit are counted as overruns, as are
+	// ticks skipped because the bus was still busy.
+	struct hrtimer captureTimer;
+	DECLARE_KFIFO_PTR(captureFifo, struct mcp23s08_sample);
+	u64 capturePeriodNs;
+	u64 captureQueuedNs;
+	uint32_t captureWordNs;
+	unsigned int captureBurst;
+	unsigned long captureOverruns;
+	wait_queue_head_t captureWait;
+	struct mutex captureLock;
+	struct mutex readLock;
+
+	struct kobject* kobj;
+	struct miscdevice miscDevice;
+	struct gpio_chip gpioChip;
+};
+
+static struct mcp23s08Device devices[MAX_DEVICES];
+static unsigned int deviceCount = 0;
+
+// Reply to a word queued without waiting for it by mcp. Playback and PWM
+// replies are thrown away, capture replies become samples.
+struct mcp23s08Reply
+{
+	struct mcp23s08Device* mcp;
+	bool sample;
+	u64 timestampNs;
+};
+
+// Process context runs whole SPI transactions under busMutex and busy-waits
+// for them preemptibly, with busClaimed set so the timers leave the bus and
+// the register caches alone meanwhile. busLock only covers the short sections
+// where the timers queue words and take replies, and claiming the bus.
+// currentCs is the chip select the core points at. replies holds the words
+// queued that nobody has read out of the RX FIFO yet, oldest first.
+static DEFINE_MUTEX(busMutex);
+static DEFINE_SPINLOCK(busLock);
+static bool busClaimed = false;
+static int currentCs = -1;
+static struct mcp23s08Reply replies[FIFO_DEPTH];
+static unsigned int replyHead = 0;
+static unsigned int replyCount = 0;
+
+static char* expanders[MAX_DEVICES];
+static int expanderCount = 0;
+module_param_array(expanders, charp, &expanderCount, S_IRUGO);
+MODULE_PARM_DESC(expanders, " Expanders as cs:address pairs, e.g. expanders=0:0,0:1,2:0 (default 0:0)");
+
+// The expander INT pins are wired to FPGA GPIO inputs that can interrupt
+static int int_gpio[MAX_DEVICES] = { [0 ... MAX_DEVICES - 1] = -1 };
+module_param_array(int_gpio, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(int_gpio, " GPIO wired to each expander's INT pin (-1 disables pin interrupts)");
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -155,30 +326,551 @@ void setWordSize(uint8_t wordSize)
 	iowrite32(readWordSize | wordSize, base + OFS_CONTROL);
 }
 
-void writeRegisterMcp23s08(uint8_t address, uint8_t data)
+// Returns the number of status reads spent spinning
+unsigned int spiWaitTxEmpty(void)
+{
+	unsigned int pollSpins = 0;
+	while (!(spiReadRegister(OFS_STATUS) & STATUS_TXFE))
+		pollSpins++;
+	return pollSpins;
+}
+
+// Time one word takes on the wire at the current word size and baud rate
+uint32_t spiWordTimeNs(void)
 {
-	uint32_t tmp = MCP23S08_ADDRESS;
+	uint32_t bits = (ioread32(base + OFS_CONTROL) & WORD_SIZE_MASK) + 1;
+	// BRD holds the half period in clock cycles with 7 fractional bits
+	u64 cycles = ((bits * 2 * (u64)ioread32(base + OFS_BRD)) >> 7) + WORD_GAP_CYCLES;
+	return (uint32_t)div_u64(cycles * NSEC_PER_SEC, CLOCK_FREQUENCY);
+}
+
+// Must be called with busLock held
+static void pushReplyLocked(struct mcp23s08Device* mcp, bool sample, u64 timestampNs)
+{
+	struct mcp23s08Reply* reply = &replies[(replyHead + replyCount) % FIFO_DEPTH];
+	reply->mcp = mcp;
+	reply->sample = sample;
+	reply->timestampNs = timestampNs;
+	replyCount++;
+}
+
+// Reads the oldest outstanding reply, which must have arrived
+// Must be called with busLock held
+static void takeReplyLocked(void)
+{
+	struct mcp23s08Reply* reply = &replies[replyHead];
+	struct mcp23s08_sample sample = { 0 };
+	uint32_t data = spiReadData();
+	replyHead = (replyHead + 1) % FIFO_DEPTH;
+	replyCount--;
+	if (!reply->sample)
+		return;
+	sample.timestamp_ns = reply->timestampNs;
+	sample.value = data & 0xFF;
+	if (!kfifo_put(&reply->mcp->captureFifo, sample))
+		reply->mcp->captureOverruns++;
+	wake_up_interruptible(&reply->mcp->captureWait);
+}
+
+// Forgets the oldest outstanding reply, which never arrived. A lost capture
+// read counts as an overrun, a lost OLAT write leaves the latch unknown.
+// Must be called with busLock held
+static void dropReplyLocked(void)
+{
+	struct mcp23s08Reply* reply = &replies[replyHead];
+	replyHead = (replyHead + 1) % FIFO_DEPTH;
+	replyCount--;
+	if (reply->sample)
+		reply->mcp->captureOverruns++;
+	else
+		reply->mcp->regCacheValid &= ~(1 << OLAT_REG);
+}
+
+// Reads the replies that have arrived so far. Once the TX FIFO has run empty
+// every queued word has shifted out and left its reply in the RX FIFO, so the
+// count must match: replies still missing were lost and words nobody queued
+// are thrown away, which puts the ring back in step with the RX FIFO.
+// Must be called with busLock held
+static void takeArrivedRepliesLocked(void)
+{
+	// TXFE is sampled first so replies arriving meanwhile are not counted lost
+	bool idle = spiReadRegister(OFS_STATUS) & STATUS_TXFE;
+	while (replyCount > 0 && !rxFifoIsEmpty())
+		takeReplyLocked();
+	if (!idle)
+		return;
+	while (replyCount > 0)
+		dropReplyLocked();
+	while (!rxFifoIsEmpty())
+		spiReadData();
+}
+
+// Playback, PWM and capture queue words without waiting for them. Anything
+// that waits for its own reply claims the bus first, which stops the timers,
+// lets their words finish with busLock dropped and takes their replies.
+// Sleeps, must not be called from the timers
+static void claimBus(void)
+{
+	unsigned long flags;
+	mutex_lock(&busMutex);
+	spin_lock_irqsave(&busLock, flags);
+	busClaimed = true;
+	spin_unlock_irqrestore(&busLock, flags);
+	spiWaitTxEmpty();
+	spin_lock_irqsave(&busLock, flags);
+	takeArrivedRepliesLocked();
+	spin_unlock_irqrestore(&busLock, flags);
+}
+
+static void releaseBus(void)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&busLock, flags);
+	busClaimed = false;
+	spin_unlock_irqrestore(&busLock, flags);
+	mutex_unlock(&busMutex);
+}
+
+// Must be called with the bus claimed, or busLock held and nothing in flight
+static void selectCsMcp23s08(uint8_t cs)
+{
+	if (currentCs != cs)
+	{
+		spiCsSelect(cs);
+		currentCs = cs;
+	}
+}
+
+// 24-bit command: opcode with the hardware address, register, data
+static uint32_t commandMcp23s08(struct mcp23s08Device* mcp, bool read, uint8_t address, uint8_t data)
+{
+	uint32_t tmp = MCP23S08_ADDRESS | (mcp->address << 1) | (read ? 1 : 0);
 	tmp = (tmp << 8) | address;
-	tmp = (tmp << 8) | data;
-	spiWriteData(tmp);
-	while (!(spiReadRegister(OFS_STATUS) & 0x20));
+	return (tmp << 8) | data;
+}
+
+// Queues an encoded OLAT write into the FIFO and leaves it to shift out on its
+// own, for timer driven output. Replies that already arrived are discarded.
+// Returns false without queueing while the bus is claimed, the RX FIFO has no
+// place left for the reply or words for another chip select are in flight,
+// the caller retries.
+// Must be called with busLock held
+static bool queueOlatMcp23s08Locked(struct mcp23s08Device* mcp, uint32_t word)
+{
+	if (busClaimed)
+		return false;
+	takeArrivedRepliesLocked();
+	if (replyCount == FIFO_DEPTH || (replyCount > 0 && currentCs != mcp->cs))
+		return false;
+	// Nothing is in flight when the chip select changes
+	if (currentCs != mcp->cs)
+		selectCsMcp23s08(mcp->cs);
+	trace_mcp23s08_submit(mcp->cs, OLAT_REG, word);
+	spiWriteData(word);
+	pushReplyLocked(mcp, false, 0);
+	mcp->regCache[OLAT_REG] = word & 0xFF;
+	mcp->regCacheValid |= 1 << OLAT_REG;
+	return true;
+}
+
+// Sends one 24-bit command and returns the word shifted in
+uint32_t transferMcp23s08(uint8_t cs, uint8_t address, uint32_t command)
+{
+	u64 start = ktime_get_ns();
+	unsigned int pollSpins;
+	uint32_t data;
+	u64 latencyNs;
+
+	selectCsMcp23s08(cs);
+	trace_mcp23s08_submit(cs, address, command);
+	spiWriteData(command);
+	trace_mcp23s08_first_word(cs, address, command);
+	pollSpins = spiWaitTxEmpty();
+	data = spiReadData();
+	trace_mcp23s08_last_word(cs, address, data);
+
+	latencyNs = ktime_get_ns() - start;
+	spiStatsRecord(&stats[cs], 1, pollSpins, latencyNs);
+	trace_mcp23s08_complete(cs, address, pollSpins, latencyNs);
+	return data;
+}
+
+void writeRegisterMcp23s08(struct mcp23s08Device* mcp, uint8_t address, uint8_t data)
+{
+	transferMcp23s08(mcp->cs, address, commandMcp23s08(mcp, false, address, data));
+}
+
+uint32_t readRegisterMcp23s08(struct mcp23s08Device* mcp, uint8_t address)
+{
+	return transferMcp23s08(mcp->cs, address, commandMcp23s08(mcp, true, address, 0xFF));
+}
+
+static bool isCacheable(uint8_t address)
+{
+	return !(VOLATILE_REGS & (1 << address));
+}
+
+// Reads a register, non-volatile registers are only read over SPI once
+uint8_t readCachedMcp23s08(struct mcp23s08Device* mcp, uint8_t address)
+{
+	uint8_t value;
+	claimBus();
+	if (isCacheable(address) && (mcp->regCacheValid & (1 << address)))
+		value = mcp->regCache[address];
+	else
+	{
+		value = readRegisterMcp23s08(mcp, address) & 0xFF;
+		if (isCacheable(address))
+		{
+			mcp->regCache[address] = value;
+			mcp->regCacheValid |= 1 << address;
+		}
+	}
+	releaseBus();
+	return value;
+}
+
+// Must be called with the bus claimed
+static void writeCachedMcp23s08Locked(struct mcp23s08Device* mcp, uint8_t address, uint8_t value)
+{
+	// Writing the value a register already holds is skipped
+	if (isCacheable(address) && (mcp->regCacheValid & (1 << address)) && mcp->regCache[address] == value)
+		return;
+	writeRegisterMcp23s08(mcp, address, value);
+	if (isCacheable(address))
+	{
+		mcp->regCache[address] = value;
+		mcp->regCacheValid |= 1 << address;
+	}
+}
+
+void writeCachedMcp23s08(struct mcp23s08Device* mcp, uint8_t address, uint8_t value)
+{
+	claimBus();
+	writeCachedMcp23s08Locked(mcp, address, value);
+	releaseBus();
+}
+
+// Sets (1) or clears (0) one bit of a register, any other value is ignored.
+// With the register cached this is a single SPI write.
+void updateBitMcp23s08(struct mcp23s08Device* mcp, uint8_t address, uint8_t bit, unsigned int value)
+{
+	uint8_t data;
+	if (value > 1)
+		return;
+	claimBus();
+	if (isCacheable(address) && (mcp->regCacheValid & (1 << address)))
+		data = mcp->regCache[address];
+	else
+		data = readRegisterMcp23s08(mcp, address) & 0xFF;
+	if (value == 0)
+		data &= ~(1 << bit);
+	else
+		data |= (1 << bit);
+	writeCachedMcp23s08Locked(mcp, address, data);
+	releaseBus();
+}
+
+// Changes the whole output latch in one SPI write:
+// OLAT = ((OLAT & ~clear) | set) ^ toggle
+void updatePortMcp23s08(struct mcp23s08Device* mcp, uint8_t clear, uint8_t set, uint8_t toggle)
+{
+	uint8_t data;
+	claimBus();
+	if (mcp->regCacheValid & (1 << OLAT_REG))
+		data = mcp->regCache[OLAT_REG];
+	else
+		data = readRegisterMcp23s08(mcp, OLAT_REG) & 0xFF;
+	data = ((data & ~clear) | set) ^ toggle;
+	writeCachedMcp23s08Locked(mcp, OLAT_REG, data);
+	releaseBus();
+}
+
+// Forces every register to be read back from the expander on next use
+void invalidateCacheMcp23s08(struct mcp23s08Device* mcp)
+{
+	claimBus();
+	mcp->regCacheValid = 0;
+	releaseBus();
+}
+
+// Reads or writes all registers in one CS frame. With IOCON.SEQOP clear the
+// expander increments the register address after every byte, so the frame is
+// opcode, register 0 and the 11 registers as 8-bit words held under manual CS.
+// The 13 words fit in the FIFO. Must be called with the bus claimed
+static void transferRegsMcp23s08Locked(struct mcp23s08Device* mcp, bool read, uint8_t* regs)
+{
+	u64 start = ktime_get_ns();
+	uint8_t opcode = commandMcp23s08(mcp, read, 0, 0) >> 16;
+	unsigned int pollSpins;
+	uint32_t control;
+	uint8_t iocon;
+	unsigned int i;
+	u64 latencyNs;
+
+	if (mcp->regCacheValid & (1 << IOCON_REG))
+		iocon = mcp->regCache[IOCON_REG];
+	else
+		iocon = readRegisterMcp23s08(mcp, IOCON_REG) & 0xFF;
+	writeCachedMcp23s08Locked(mcp, IOCON_REG, iocon & ~IOCON_SEQOP);
+
+	if (!read)
+	{
+		// IOCON keeps the current addressing and sequential mode, a GPIO
+		// write lands in OLAT so it carries the OLAT value
+		regs[IOCON_REG] = (regs[IOCON_REG] & ~(IOCON_SEQOP | IOCON_HAEN)) | (iocon & IOCON_HAEN);
+		regs[DATA_REG] = regs[OLAT_REG];
+	}
+
+	selectCsMcp23s08(mcp->cs);
+	control = ioread32(base + OFS_CONTROL);
+	// Hand the chip select over to software while it is still high
+	spiEnableCS(mcp->cs);
+	spiCsAutoDisable(mcp->cs);
+	setWordSize(7);
+	spiDisableCS(mcp->cs);
+
+	trace_mcp23s08_submit(mcp->cs, 0, opcode);
+	spiWriteData(opcode);
+	spiWriteData(0);
+	for (i = 0; i < REG_COUNT; i++)
+		spiWriteData(read ? 0xFF : regs[i]);
+	pollSpins = spiWaitTxEmpty();
+	spiEnableCS(mcp->cs);
+
+	spiReadData();
 	spiReadData();
+	for (i = 0; i < REG_COUNT; i++)
+	{
+		uint8_t value = spiReadData() & 0xFF;
+		if (read)
+			regs[i] = value;
+	}
+	iowrite32(control, base + OFS_CONTROL);
+
+	for (i = 0; i < REG_COUNT; i++)
+		if (isCacheable(i))
+			mcp->regCache[i] = regs[i];
+	mcp->regCacheValid |= ~VOLATILE_REGS & ((1 << REG_COUNT) - 1);
+
+	latencyNs = ktime_get_ns() - start;
+	spiStatsRecord(&stats[mcp->cs], SEQ_FRAME_WORDS, pollSpins, latencyNs);
+	trace_mcp23s08_complete(mcp->cs, 0, pollSpins, latencyNs);
 }
 
-uint32_t readRegisterMcp23s08(uint8_t address)
+void readRegsMcp23s08(struct mcp23s08Device* mcp, uint8_t* regs)
 {
-	uint32_t tmp = MCP23S08_ADDRESS | 1;
-	tmp = (tmp << 8) | address;
-	tmp = (tmp << 8) | 0xFF;
-	spiWriteData(tmp);
-	while (!(spiReadRegister(OFS_STATUS) & 0x20));
-	return spiReadData();
+	claimBus();
+	transferRegsMcp23s08Locked(mcp, true, regs);
+	releaseBus();
+}
+
+void writeRegsMcp23s08(struct mcp23s08Device* mcp, uint8_t* regs)
+{
+	claimBus();
+	transferRegsMcp23s08Locked(mcp, false, regs);
+	releaseBus();
+}
+
+// Writes OLAT of every device set in mask. The words for expanders sharing a
+// chip select are queued into the FIFO together and waited on once, each word
+// still gets its own CS frame. Unchanged latches are skipped.
+void writePortsMcp23s08(const uint8_t* values, uint16_t mask)
+{
+	unsigned int pollSpins;
+	unsigned int cs, i, n;
+	u64 start, latencyNs;
+
+	claimBus();
+	for (cs = 0; cs < CS_COUNT; cs++)
+	{
+		start = ktime_get_ns();
+		n = 0;
+		for (i = 0; i < deviceCount; i++)
+		{
+			struct mcp23s08Device* mcp = &devices[i];
+			uint32_t command;
+			if (mcp->cs != cs || !(mask & (1 << i)))
+				continue;
+			if ((mcp->regCacheValid & (1 << OLAT_REG)) && mcp->regCache[OLAT_REG] == values[i])
+				continue;
+			selectCsMcp23s08(cs);
+			command = commandMcp23s08(mcp, false, OLAT_REG, values[i]);
+			trace_mcp23s08_submit(cs, OLAT_REG, command);
+			spiWriteData(command);
+			mcp->regCache[OLAT_REG] = values[i];
+			mcp->regCacheValid |= 1 << OLAT_REG;
+			n++;
+		}
+		if (n == 0)
+			continue;
+		pollSpins = spiWaitTxEmpty();
+		for (i = 0; i < n; i++)
+			spiReadData();
+		latencyNs = ktime_get_ns() - start;
+		spiStatsRecord(&stats[cs], n, pollSpins, latencyNs);
+		trace_mcp23s08_complete(cs, OLAT_REG, pollSpins, latencyNs);
+	}
+	releaseBus();
+}
+
+// Reads GPIO of every device, batched per chip select like writePortsMcp23s08
+void readPortsMcp23s08(uint8_t* values)
+{
+	unsigned int pollSpins;
+	unsigned int cs, i, n;
+	u64 start, latencyNs;
+
+	claimBus();
+	for (cs = 0; cs < CS_COUNT; cs++)
+	{
+		start = ktime_get_ns();
+		n = 0;
+		for (i = 0; i < deviceCount; i++)
+		{
+			if (devices[i].cs != cs)
+				continue;
+			selectCsMcp23s08(cs);
+			spiWriteData(commandMcp23s08(&devices[i], true, DATA_REG, 0xFF));
+			n++;
+		}
+		if (n == 0)
+			continue;
+		pollSpins = spiWaitTxEmpty();
+		// Replies come back in the order the commands were queued
+		for (i = 0; i < deviceCount; i++)
+			if (devices[i].cs == cs)
+				values[i] = spiReadData() & 0xFF;
+		latencyNs = ktime_get_ns() - start;
+		spiStatsRecord(&stats[cs], n, pollSpins, latencyNs);
+		trace_mcp23s08_complete(cs, DATA_REG, pollSpins, latencyNs);
+	}
+	releaseBus();
+}
+
+// One timer serves every PWM pin of an expander. Each expiry advances all the
+// pins with an edge due, then writes the merged port once, so pins with the
+// same period share their rising edges.
+static enum hrtimer_restart pwmTimerHandler(struct hrtimer* timer)
+{
+	struct mcp23s08Device* mcp = container_of(timer, struct mcp23s08Device, pwmTimer);
+	u64 now = ktime_get_ns();
+	u64 next = U64_MAX;
+	uint8_t level = mcp->pwmLevel;
+	unsigned long flags;
+	unsigned int pin;
+	bool queued;
+
+	for (pin = 0; pin < 8; pin++)
+	{
+		uint8_t bit = 1 << pin;
+		if (!(mcp->pwmEnabled & bit))
+			continue;
+		// Catches up on edges missed if the timer ran late
+		while (mcp->pwmNext[pin] <= now + PWM_COALESCE_NS)
+		{
+			if (level & bit)
+				mcp->pwmNext[pin] += mcp->pwmPeriodNs[pin] - mcp->pwmDutyNs[pin];
+			else
+				mcp->pwmNext[pin] += mcp->pwmDutyNs[pin];
+			level ^= bit;
+		}
+		next = min(next, mcp->pwmNext[pin]);
+	}
+	mcp->pwmLevel = level;
+
+	spin_lock_irqsave(&busLock, flags);
+	queued = !busClaimed && queueOlatMcp23s08Locked(mcp, commandMcp23s08(mcp, false, OLAT_REG, (mcp->regCache[OLAT_REG] & ~mcp->pwmEnabled) | (level & mcp->pwmEnabled)));
+	spin_unlock_irqrestore(&busLock, flags);
+
+	// A write that did not fit is retried once a word has shifted out
+	if (!queued)
+		next = min(next, now + spiWordTimeNs());
+	hrtimer_set_expires(timer, ns_to_ktime(next));
+	return HRTIMER_RESTART;
+}
+
+// Runs pin at period with duty high time. A period of 0, or a high or low
+// time shorter than PWM_MIN_NS, stops PWM and leaves the pin at a fixed level.
+void setPwmMcp23s08(struct mcp23s08Device* mcp, unsigned int pin, u64 periodNs, u64 dutyNs)
+{
+	uint8_t bit = 1 << pin;
+	u64 now;
+
+	mutex_lock(&mcp->pwmLock);
+	hrtimer_cancel(&mcp->pwmTimer);
+	// Make sure OLAT is cached, the timer only merges into the cached value
+	readCachedMcp23s08(mcp, OLAT_REG);
+
+	if (periodNs == 0 || dutyNs < PWM_MIN_NS || periodNs - min(dutyNs, periodNs) < PWM_MIN_NS)
+	{
+		mcp->pwmEnabled &= ~bit;
+		updateBitMcp23s08(mcp, OLAT_REG, pin, (periodNs != 0 && dutyNs >= periodNs / 2) ? 1 : 0);
+	}
+	else
+	{
+		now = ktime_get_ns();
+		if (mcp->pwmEnabled == 0)
+			mcp->pwmEpoch = now;
+		// Periods start on a common grid so equal periods line up
+		mcp->pwmPeriodNs[pin] = periodNs;
+		mcp->pwmDutyNs[pin] = dutyNs;
+		mcp->pwmNext[pin] = mcp->pwmEpoch + div64_u64(now - mcp->pwmEpoch + periodNs - 1, periodNs) * periodNs;
+		mcp->pwmLevel &= ~bit;
+		mcp->pwmEnabled |= bit;
+	}
+
+	if (mcp->pwmEnabled != 0)
+	{
+		unsigned int i;
+		u64 next = U64_MAX;
+		for (i = 0; i < 8; i++)
+			if (mcp->pwmEnabled & (1 << i))
+				next = min(next, mcp->pwmNext[i]);
+		hrtimer_start(&mcp->pwmTimer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+	}
+	mutex_unlock(&mcp->pwmLock);
+}
+
+// Expanders power up with HAEN clear and all answer to address 0, so one IOCON
+// write to address 0 turns on hardware addressing for every chip on a CS.
+static void enableHardwareAddressMcp23s08(void)
+{
+	uint8_t csMask = 0;
+	unsigned int cs, i;
+
+	for (i = 0; i < deviceCount; i++)
+		if (devices[i].address != 0)
+			csMask |= 1 << devices[i].cs;
+
+	claimBus();
+	for (cs = 0; cs < CS_COUNT; cs++)
+		if (csMask & (1 << cs))
+			transferMcp23s08(cs, IOCON_REG, (MCP23S08_ADDRESS << 16) | (IOCON_REG << 8) | IOCON_HAEN);
+	for (i = 0; i < deviceCount; i++)
+	{
+		if (csMask & (1 << devices[i].cs))
+		{
+			devices[i].regCache[IOCON_REG] = IOCON_HAEN;
+			devices[i].regCacheValid |= 1 << IOCON_REG;
+		}
+	}
+	releaseBus();
 }
 
 //-----------------------------------------------------------------------------
 // Kernel Objects
 //-----------------------------------------------------------------------------
 
+static struct mcp23s08Device* mcp23s08FromKobj(struct kobject* kobj)
+{
+	unsigned int i;
+	for (i = 0; i < deviceCount; i++)
+		if (devices[i].kobj == kobj)
+			return &devices[i];
+	return &devices[0];
+}
+
 // Pin 0
 static unsigned int dir_0 = 0;
 // Root, Registered User, Guest - S_IRUGO
@@ -188,22 +880,14 @@ MODULE_PARM_DESC(dir_0, " Set the pin as an input or output");
 static ssize_t direction0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_0);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_0 == 0)
-			dir &= ~(1 << 0);
-		else if(dir_0 == 1)
-			dir |= (1 << 0);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 0, dir_0);
 	return count;
 }
 
 static ssize_t direction0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_0 = readRegisterMcp23s08(DIR_REG);
+	dir_0 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_0 & 1) ? 1 : 0);
 }
 
@@ -217,22 +901,14 @@ MODULE_PARM_DESC(data_0, " Set the pin low or high");
 static ssize_t data0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_0);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_0 == 0)
-			data &= ~(1 << 0);
-		else if (data_0 == 1)
-			data |= (1 << 0);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 0, data_0);
 	return count;
 }
 
 static ssize_t data0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_0 = readRegisterMcp23s08(DATA_REG);
+	data_0 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_0 & 1) ? 1 : 0);
 }
 
@@ -246,22 +922,14 @@ MODULE_PARM_DESC(pullup_0, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_0);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_0 == 0)
-			pullup &= ~(1 << 0);
-		else if (pullup_0 == 1)
-			pullup |= (1 << 0);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 0, pullup_0);
 	return count;
 }
 
 static ssize_t pullup0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_0 = readRegisterMcp23s08(GPPU_REG);
+	pullup_0 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_0 & 1) ? 1 : 0);
 }
 
@@ -276,22 +944,14 @@ MODULE_PARM_DESC(dir_1, " Set the pin as an input or output");
 static ssize_t direction1Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_1);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_1 == 0)
-			dir &= ~(1 << 1);
-		else if (dir_1 == 1)
-			dir |= (1 << 1);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 1, dir_1);
 	return count;
 }
 
 static ssize_t direction1Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_1 = readRegisterMcp23s08(DIR_REG);
+	dir_1 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_1 & 2) ? 1 : 0);
 }
 
@@ -305,22 +965,14 @@ MODULE_PARM_DESC(data_1, " Set the pin low or high");
 static ssize_t data1Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_1);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_1 == 0)
-			data &= ~(1 << 1);
-		else if (data_1 == 1)
-			data |= (1 << 1);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 1, data_1);
 	return count;
 }
 
 static ssize_t data1Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_1 = readRegisterMcp23s08(DATA_REG);
+	data_1 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_1 & 2) ? 1 : 0);
 }
 
@@ -334,22 +986,14 @@ MODULE_PARM_DESC(pullup_1, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup1Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_1);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_1 == 0)
-			pullup &= ~(1 << 1);
-		else if (pullup_1 == 1)
-			pullup |= (1 << 1);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 1, pullup_1);
 	return count;
 }
 
 static ssize_t pullup1Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_1 = readRegisterMcp23s08(GPPU_REG);
+	pullup_1 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_1 & 2) ? 1 : 0);
 }
 
@@ -364,22 +1008,14 @@ MODULE_PARM_DESC(dir_2, " Set the pin as an input or output");
 static ssize_t direction2Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_2);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_2 == 0)
-			dir &= ~(1 << 2);
-		else if (dir_2 == 1)
-			dir |= (1 << 2);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 2, dir_2);
 	return count;
 }
 
 static ssize_t direction2Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_2 = readRegisterMcp23s08(DIR_REG);
+	dir_2 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_2 & 4) ? 1 : 0);
 }
 
@@ -393,22 +1029,14 @@ MODULE_PARM_DESC(data_2, " Set the pin low or high");
 static ssize_t data2Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_2);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_2 == 0)
-			data &= ~(1 << 2);
-		else if (data_2 == 1)
-			data |= (1 << 2);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 2, data_2);
 	return count;
 }
 
 static ssize_t data2Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_2 = readRegisterMcp23s08(DATA_REG);
+	data_2 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_2 & 4) ? 1 : 0);
 }
 
@@ -422,22 +1050,14 @@ MODULE_PARM_DESC(pullup_2, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup2Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_2);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_2 == 0)
-			pullup &= ~(1 << 2);
-		else if (pullup_2 == 1)
-			pullup |= (1 << 2);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 2, pullup_2);
 	return count;
 }
 
 static ssize_t pullup2Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_2 = readRegisterMcp23s08(GPPU_REG);
+	pullup_2 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_2 & 4) ? 1 : 0);
 }
 
@@ -452,22 +1072,14 @@ MODULE_PARM_DESC(dir_3, " Set the pin as an input or output");
 static ssize_t direction3Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_3);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_3 == 0)
-			dir &= ~(1 << 3);
-		else if (dir_3 == 1)
-			dir |= (1 << 3);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 3, dir_3);
 	return count;
 }
 
 static ssize_t direction3Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_3 = readRegisterMcp23s08(DIR_REG);
+	dir_3 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_3 & 8) ? 1 : 0);
 }
 
@@ -481,22 +1093,14 @@ MODULE_PARM_DESC(data_3, " Set the pin low or high");
 static ssize_t data3Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_3);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_3 == 0)
-			data &= ~(1 << 3);
-		else if (data_3 == 1)
-			data |= (1 << 3);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 3, data_3);
 	return count;
 }
 
 static ssize_t data3Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_3 = readRegisterMcp23s08(DATA_REG);
+	data_3 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_3 & 8) ? 1 : 0);
 }
 
@@ -510,22 +1114,14 @@ MODULE_PARM_DESC(pullup_3, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup3Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_3);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_3 == 0)
-			pullup &= ~(1 << 3);
-		else if (pullup_3 == 1)
-			pullup |= (1 << 3);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 3, pullup_3);
 	return count;
 }
 
 static ssize_t pullup3Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_3 = readRegisterMcp23s08(GPPU_REG);
+	pullup_3 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_3 & 8) ? 1 : 0);
 }
 
@@ -540,22 +1136,14 @@ MODULE_PARM_DESC(dir_4, " Set the pin as an input or output");
 static ssize_t direction4Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_4);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_4 == 0)
-			dir &= ~(1 << 4);
-		else if (dir_4 == 1)
-			dir |= (1 << 4);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 4, dir_4);
 	return count;
 }
 
 static ssize_t direction4Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_4 = readRegisterMcp23s08(DIR_REG);
+	dir_4 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_4 & 16) ? 1 : 0);
 }
 
@@ -569,22 +1157,14 @@ MODULE_PARM_DESC(data_4, " Set the pin low or high");
 static ssize_t data4Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_4);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_4 == 0)
-			data &= ~(1 << 4);
-		else if (data_4 == 1)
-			data |= (1 << 4);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 4, data_4);
 	return count;
 }
 
 static ssize_t data4Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_4 = readRegisterMcp23s08(DATA_REG);
+	data_4 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_4 & 16) ? 1 : 0);
 }
 
@@ -598,22 +1178,14 @@ MODULE_PARM_DESC(pullup_4, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup4Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_4);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_4 == 0)
-			pullup &= ~(1 << 4);
-		else if (pullup_4 == 1)
-			pullup |= (1 << 4);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 4, pullup_4);
 	return count;
 }
 
 static ssize_t pullup4Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_4 = readRegisterMcp23s08(GPPU_REG);
+	pullup_4 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_4 & 16) ? 1 : 0);
 }
 
@@ -628,22 +1200,14 @@ MODULE_PARM_DESC(dir_5, " Set the pin as an input or output");
 static ssize_t direction5Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_5);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_5 == 0)
-			dir &= ~(1 << 5);
-		else if (dir_5 == 1)
-			dir |= (1 << 5);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 5, dir_5);
 	return count;
 }
 
 static ssize_t direction5Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_5 = readRegisterMcp23s08(DIR_REG);
+	dir_5 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_5 & 32) ? 1 : 0);
 }
 
@@ -657,22 +1221,14 @@ MODULE_PARM_DESC(data_5, " Set the pin low or high");
 static ssize_t data5Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_5);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_5 == 0)
-			data &= ~(1 << 5);
-		else if (data_5 == 1)
-			data |= (1 << 5);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 5, data_5);
 	return count;
 }
 
 static ssize_t data5Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_5 = readRegisterMcp23s08(DATA_REG);
+	data_5 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_5 & 32) ? 1 : 0);
 }
 
@@ -686,22 +1242,14 @@ MODULE_PARM_DESC(pullup_5, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup5Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_5);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_5 == 0)
-			pullup &= ~(1 << 5);
-		else if (pullup_5 == 1)
-			pullup |= (1 << 5);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 5, pullup_5);
 	return count;
 }
 
 static ssize_t pullup5Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_5 = readRegisterMcp23s08(GPPU_REG);
+	pullup_5 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_5 & 32) ? 1 : 0);
 }
 
@@ -716,22 +1264,14 @@ MODULE_PARM_DESC(dir_6, " Set the pin as an input or output");
 static ssize_t direction6Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_6);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_6 == 0)
-			dir &= ~(1 << 7);
-		else if (dir_6 == 1)
-			dir |= (1 << 7);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 6, dir_6);
 	return count;
 }
 
 static ssize_t direction6Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_6 = readRegisterMcp23s08(DIR_REG);
+	dir_6 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_6 & 64) ? 1 : 0);
 }
 
@@ -745,22 +1285,14 @@ MODULE_PARM_DESC(data_6, " Set the pin low or high");
 static ssize_t data6Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_6);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_6 == 0)
-			data &= ~(1 << 6);
-		else if (data_6 == 1)
-			data |= (1 << 6);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 6, data_6);
 	return count;
 }
 
 static ssize_t data6Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_6 = readRegisterMcp23s08(DATA_REG);
+	data_6 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_6 & 64) ? 1 : 0);
 }
 
@@ -774,22 +1306,14 @@ MODULE_PARM_DESC(pullup_6, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup6Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_6);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_6 == 0)
-			pullup &= ~(1 << 6);
-		else if (pullup_6 == 1)
-			pullup |= (1 << 6);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 6, pullup_6);
 	return count;
 }
 
 static ssize_t pullup6Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_6 = readRegisterMcp23s08(GPPU_REG);
+	pullup_6 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_6 & 64) ? 1 : 0);
 }
 
@@ -804,22 +1328,14 @@ MODULE_PARM_DESC(dir_7, " Set the pin as an input or output");
 static ssize_t direction7Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &dir_7);
-	uint32_t dir = 0;
 	if (result == 0)
-	{
-		dir = readRegisterMcp23s08(DIR_REG);
-		if (dir_7 == 0)
-			dir &= ~(1 << 7);
-		else if (dir_7 == 1)
-			dir |= (1 << 7);
-		writeRegisterMcp23s08(DIR_REG, (dir & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), DIR_REG, 7, dir_7);
 	return count;
 }
 
 static ssize_t direction7Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	dir_7 = readRegisterMcp23s08(DIR_REG);
+	dir_7 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DIR_REG);
 	return sprintf(buffer, "%hhx\n", (dir_7 & 128) ? 1 : 0);
 }
 
@@ -833,22 +1349,14 @@ MODULE_PARM_DESC(data_7, " Set the pin low or high");
 static ssize_t data7Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &data_7);
-	uint32_t data = 0;
 	if (result == 0)
-	{
-		data = readRegisterMcp23s08(DATA_REG);
-		if (data_7 == 0)
-			data &= ~(1 << 7);
-		else if (data_7 == 1)
-			data |= (1 << 7);
-		writeRegisterMcp23s08(DATA_REG, (data & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, 7, data_7);
 	return count;
 }
 
 static ssize_t data7Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	data_7 = readRegisterMcp23s08(DATA_REG);
+	data_7 = readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG);
 	return sprintf(buffer, "%hhx\n", (data_7 & 128) ? 1 : 0);
 }
 
@@ -862,28 +1370,205 @@ MODULE_PARM_DESC(pullup_7, " Set the pin to have a pull up resistor internally")
 static ssize_t pullup7Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
 	unsigned int result = kstrtouint(buffer, 0, &pullup_7);
-	uint32_t pullup = 0;
 	if (result == 0)
-	{
-		pullup = readRegisterMcp23s08(GPPU_REG);
-		if (pullup_7 == 0)
-			pullup &= ~(1 << 7);
-		else if (pullup_7 == 1)
-			pullup |= (1 << 7);
-		writeRegisterMcp23s08(GPPU_REG, (pullup & 0xFF));
-	}
+		updateBitMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG, 7, pullup_7);
 	return count;
 }
 
 static ssize_t pullup7Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	pullup_7 = readRegisterMcp23s08(GPPU_REG);
+	pullup_7 = readCachedMcp23s08(mcp23s08FromKobj(kobj), GPPU_REG);
 	return sprintf(buffer, "%hhx\n", (pullup_7 & 128) ? 1 : 0);
 }
 
 static struct kobj_attribute pullup7Attr = __ATTR(pullup, 0664, pullup7Show, pullup7Store);
 
+// Register cache
+static ssize_t invalidateCacheStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	invalidateCacheMcp23s08(mcp23s08FromKobj(kobj));
+	return count;
+}
+
+static struct kobj_attribute invalidateCacheAttr = __ATTR(invalidate_cache, 0220, NULL, invalidateCacheStore);
+
+// Port
+static ssize_t portStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	uint8_t value;
+	unsigned int result = kstrtou8(buffer, 0, &value);
+	if (result == 0)
+		writeCachedMcp23s08(mcp23s08FromKobj(kobj), OLAT_REG, value);
+	return count;
+}
+
+static ssize_t portShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	return sprintf(buffer, "0x%02hhx\n", readCachedMcp23s08(mcp23s08FromKobj(kobj), DATA_REG));
+}
+
+static struct kobj_attribute portAttr = __ATTR(port, 0664, portShow, portStore);
+
+static ssize_t portSetStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	uint8_t mask;
+	unsigned int result = kstrtou8(buffer, 0, &mask);
+	if (result == 0)
+		updatePortMcp23s08(mcp23s08FromKobj(kobj), 0, mask, 0);
+	return count;
+}
+
+static struct kobj_attribute portSetAttr = __ATTR(port_set, 0220, NULL, portSetStore);
+
+static ssize_t portClearStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	uint8_t mask;
+	unsigned int result = kstrtou8(buffer, 0, &mask);
+	if (result == 0)
+		updatePortMcp23s08(mcp23s08FromKobj(kobj), mask, 0, 0);
+	return count;
+}
+
+static struct kobj_attribute portClearAttr = __ATTR(port_clear, 0220, NULL, portClearStore);
+
+static ssize_t portToggleStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	uint8_t mask;
+	unsigned int result = kstrtou8(buffer, 0, &mask);
+	if (result == 0)
+		updatePortMcp23s08(mcp23s08FromKobj(kobj), 0, 0, mask);
+	return count;
+}
+
+static struct kobj_attribute portToggleAttr = __ATTR(port_toggle, 0220, NULL, portToggleStore);
+
+// All expanders at once, one value per device in the order of the expanders
+// parameter. A - leaves that device alone.
+static ssize_t portsStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	uint8_t values[MAX_DEVICES];
+	uint16_t mask = 0;
+	unsigned int i = 0;
+	char* copy = kstrndup(buffer, count, GFP_KERNEL);
+	char* cursor = copy;
+	char* token;
+
+	if (copy == NULL)
+		return -ENOMEM;
+	while ((token = strsep(&cursor, " \t\n")) != NULL && i < deviceCount)
+	{
+		if (*token == '\0')
+			continue;
+		if (strcmp(token, "-") != 0 && kstrtou8(token, 0, &values[i]) == 0)
+			mask |= 1 << i;
+		i++;
+	}
+	kfree(copy);
+
+	writePortsMcp23s08(values, mask);
+	return count;
+}
+
+static ssize_t portsShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	uint8_t values[MAX_DEVICES];
+	unsigned int i;
+	int length = 0;
+
+	readPortsMcp23s08(values);
+	for (i = 0; i < deviceCount; i++)
+		length += sprintf(buffer + length, "0x%02hhx%c", values[i], (i + 1 == deviceCount) ? '\n' : ' ');
+	return length;
+}
+
+static struct kobj_attribute portsAttr = __ATTR(ports, 0664, portsShow, portsStore);
+
+// Every register from IODIR to OLAT as hex bytes, read or written in one frame
+static ssize_t regsStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	struct mcp23s08Device* mcp;
+	uint8_t regs[REG_COUNT];
+	unsigned int i = 0;
+	char* copy = kstrndup(buffer, count, GFP_KERNEL);
+	char* cursor = copy;
+	char* token;
+
+	if (copy == NULL)
+		return -ENOMEM;
+	while ((token = strsep(&cursor, " \t\n")) != NULL && i < REG_COUNT)
+	{
+		if (*token == '\0')
+			continue;
+		if (kstrtou8(token, 16, &regs[i]) != 0)
+			break;
+		i++;
+	}
+	kfree(copy);
+
+	if (i != REG_COUNT)
+		return -EINVAL;
+	// The interrupt registers are rewritten from the irq_chip state on the
+	// next irq_bus_sync_unlock, so that state follows the restore
+	mcp = mcp23s08FromKobj(kobj);
+	mutex_lock(&mcp->irqLock);
+	writeRegsMcp23s08(mcp, regs);
+	mcp->irqEnabled = regs[GPINTEN_REG];
+	mcp->irqIntcon = regs[INTCON_REG];
+	mcp->irqDefval = regs[DEFVAL_REG];
+	mutex_unlock(&mcp->irqLock);
+	return count;
+}
+
+static ssize_t regsShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	uint8_t regs[REG_COUNT];
+	unsigned int i;
+	int length = 0;
+
+	readRegsMcp23s08(mcp23s08FromKobj(kobj), regs);
+	for (i = 0; i < REG_COUNT; i++)
+		length += sprintf(buffer + length, "%02hhx%c", regs[i], (i + 1 == REG_COUNT) ? '\n' : ' ');
+	return length;
+}
+
+static struct kobj_attribute regsAttr = __ATTR(regs, 0664, regsShow, regsStore);
+
+// PWM, written as "pin period_us duty_us"
+static ssize_t pwmStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	unsigned int pin, periodUs, dutyUs;
+	if (sscanf(buffer, "%u %u %u", &pin, &periodUs, &dutyUs) != 3 || pin > 7)
+		return -EINVAL;
+	setPwmMcp23s08(mcp23s08FromKobj(kobj), pin, (u64)periodUs * NSEC_PER_USEC, (u64)dutyUs * NSEC_PER_USEC);
+	return count;
+}
+
+static ssize_t pwmShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromKobj(kobj);
+	unsigned int pin;
+	int length = 0;
+
+	mutex_lock(&mcp->pwmLock);
+	for (pin = 0; pin < 8; pin++)
+		if (mcp->pwmEnabled & (1 << pin))
+			length += sprintf(buffer + length, "%u %llu %llu\n", pin, div_u64(mcp->pwmPeriodNs[pin], NSEC_PER_USEC), div_u64(mcp->pwmDutyNs[pin], NSEC_PER_USEC));
+	mutex_unlock(&mcp->pwmLock);
+	return length;
+}
+
+static struct kobj_attribute pwmAttr = __ATTR(pwm, 0664, pwmShow, pwmStore);
+
+// Capture
+static ssize_t captureOverrunsShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	return sprintf(buffer, "%lu\n", mcp23s08FromKobj(kobj)->captureOverruns);
+}
+
+static struct kobj_attribute captureOverrunsAttr = __ATTR(capture_overruns, 0444, captureOverrunsShow, NULL);
+
 // Attributes
+static struct attribute* attrs[] = { &invalidateCacheAttr.attr, &portAttr.attr, &portSetAttr.attr, &portClearAttr.attr, &portToggleAttr.attr, &regsAttr.attr, &captureOverrunsAttr.attr, &pwmAttr.attr, NULL };
 static struct attribute* dev0Attrs[] = { &dir0Attr.attr, &data0Attr.attr, &pullup0Attr.attr, NULL };
 static struct attribute* dev1Attrs[] = { &dir1Attr.attr, &data1Attr.attr, &pullup1Attr.attr, NULL };
 static struct attribute* dev2Attrs[] = { &dir2Attr.attr, &data2Attr.attr, &pullup2Attr.attr, NULL };
@@ -941,82 +1626,757 @@ static struct attribute_group group7 =
 	.attrs = dev7Attrs
 };
 
-static struct kobject* kobj;
+static const struct attribute_group* groups[] = { &group0, &group1, &group2, &group3, &group4, &group5, &group6, &group7, NULL };
 
 //-----------------------------------------------------------------------------
-// Initialization and Exit
+// Character Device
 //-----------------------------------------------------------------------------
 
-static int __init initialize_module(void)
+// Runs at each step time
+static enum hrtimer_restart playTimerHandler(struct hrtimer* timer)
+{
+	struct mcp23s08Device* mcp = container_of(timer, struct mcp23s08Device, playTimer);
+	struct mcp23s08PlayStep* step = &mcp->playSteps[mcp->playIndex];
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&busLock, flags);
+	queued = queueOlatMcp23s08Locked(mcp, step->word);
+	spin_unlock_irqrestore(&busLock, flags);
+
+	// A step that did not fit goes out late, the steps after it keep their times
+	if (!queued)
+	{
+		hrtimer_forward_now(timer, ns_to_ktime(spiWordTimeNs()));
+		return HRTIMER_RESTART;
+	}
+
+	if (++mcp->playIndex == mcp->playCount)
+	{
+		mcp->playIndex = 0;
+		if (mcp->playLoops != 0 && --mcp->playLoops == 0)
+			return HRTIMER_NORESTART;
+	}
+	// Step times are kept relative to the first one so they never drift
+	mcp->playDueNs += step->delayNs;
+	hrtimer_set_expires(timer, ns_to_ktime(mcp->playDueNs));
+	return HRTIMER_RESTART;
+}
+
+// Must be called with playLock held
+static void stopPlaybackLocked(struct mcp23s08Device* mcp)
+{
+	hrtimer_cancel(&mcp->playTimer);
+	kfree(mcp->playSteps);
+	mcp->playSteps = NULL;
+}
+
+static long startPlayback(struct mcp23s08Device* mcp, struct mcp23s08_playback __user* user)
+{
+	struct mcp23s08_playback playback;
+	struct mcp23s08_step* steps;
+	struct mcp23s08PlayStep* playSteps;
+	unsigned int i;
+
+	if (copy_from_user(&playback, user, sizeof(playback)))
+		return -EFAULT;
+	if (playback.count == 0 || playback.count > MCP23S08_MAX_STEPS)
+		return -EINVAL;
+
+	steps = kmalloc_array(playback.count, sizeof(*steps), GFP_KERNEL);
+	playSteps = kmalloc_array(playback.count, sizeof(*playSteps), GFP_KERNEL);
+	if (steps == NULL || playSteps == NULL)
+	{
+		kfree(steps);
+		kfree(playSteps);
+		return -ENOMEM;
+	}
+	if (copy_from_user(steps, u64_to_user_ptr(playback.steps), playback.count * sizeof(*steps)))
+	{
+		kfree(steps);
+		kfree(playSteps);
+		return -EFAULT;
+	}
+	for (i = 0; i < playback.count; i++)
+	{
+		playSteps[i].word = commandMcp23s08(mcp, false, OLAT_REG, steps[i].value);
+		playSteps[i].delayNs = (u64)max_t(uint32_t, steps[i].delay_us, MCP23S08_MIN_DELAY_US) * NSEC_PER_USEC;
+	}
+	kfree(steps);
+
+	mutex_lock(&mcp->playLock);
+	stopPlaybackLocked(mcp);
+	mcp->playSteps = playSteps;
+	mcp->playCount = playback.count;
+	mcp->playIndex = 0;
+	mcp->playLoops = playback.loops;
+	mcp->playDueNs = ktime_get_ns();
+	hrtimer_start(&mcp->playTimer, ns_to_ktime(mcp->playDueNs), HRTIMER_MODE_ABS);
+	mutex_unlock(&mcp->playLock);
+	return 0;
+}
+
+// Each tick takes the replies to the previous burst that have come in and
+// queues the next burst of GPIO reads back to back, it never waits on the bus.
+// A tick is skipped when the bus is claimed, when the RX FIFO has no room for
+// the burst or when words for another chip select are still shifting out.
+static enum hrtimer_restart captureTimerHandler(struct hrtimer* timer)
+{
+	struct mcp23s08Device* mcp = container_of(timer, struct mcp23s08Device, captureTimer);
+	uint32_t command = commandMcp23s08(mcp, true, DATA_REG, 0xFF);
+	unsigned long flags;
+	unsigned int i;
+	u64 now;
+
+	spin_lock_irqsave(&busLock, flags);
+	if (!busClaimed)
+		takeArrivedRepliesLocked();
+	now = ktime_get_ns();
+	if (busClaimed || replyCount + mcp->captureBurst > FIFO_DEPTH || (replyCount > 0 && currentCs != mcp->cs))
+		mcp->captureOverruns += mcp->captureBurst;
+	else
+	{
+		// Nothing is in flight when the chip select changes
+		if (currentCs != mcp->cs)
+			selectCsMcp23s08(mcp->cs);
+		trace_mcp23s08_submit(mcp->cs, DATA_REG, command);
+		// Words still in flight go first, the timestamps are estimated from
+		// the word time rather than measured
+		for (i = 0; i < mcp->captureBurst; i++)
+		{
+			spiWriteData(command);
+			pushReplyLocked(mcp, true, now + (u64)(replyCount + 1) * mcp->captureWordNs);
+		}
+		if (mcp->captureQueuedNs != 0)
+		{
+			spiStatsRecord(&stats[mcp->cs], mcp->captureBurst, 0, now - mcp->captureQueuedNs);
+			trace_mcp23s08_complete(mcp->cs, DATA_REG, 0, now - mcp->captureQueuedNs);
+		}
+		mcp->captureQueuedNs = now;
+	}
+	spin_unlock_irqrestore(&busLock, flags);
+
+	// Ticks missed while the bus was busy are skipped rather than bunched up
+	hrtimer_forward_now(timer, ns_to_ktime(mcp->capturePeriodNs));
+	return HRTIMER_RESTART;
+}
+
+// Stops the timer and takes the replies to the last burst
+// Must be called with captureLock held
+static void stopCaptureLocked(struct mcp23s08Device* mcp)
+{
+	hrtimer_cancel(&mcp->captureTimer);
+	claimBus();
+	releaseBus();
+}
+
+static void stopCapture(struct mcp23s08Device* mcp)
+{
+	mutex_lock(&mcp->captureLock);
+	stopCaptureLocked(mcp);
+	mutex_unlock(&mcp->captureLock);
+}
+
+static long startCapture(struct mcp23s08Device* mcp, struct mcp23s08_capture __user* user)
+{
+	struct mcp23s08_capture capture;
+	uint32_t wordNs;
+	int result = 0;
+
+	if (copy_from_user(&capture, user, sizeof(capture)))
+		return -EFAULT;
+	if (capture.rate_hz == 0 || capture.rate_hz > MCP23S08_MAX_CAPTURE_HZ || capture.burst == 0 || capture.burst > FIFO_DEPTH)
+		return -EINVAL;
+
+	// The reads may only take a share of the bus at the current baud rate
+	wordNs = spiWordTimeNs();
+	if ((u64)capture.rate_hz * wordNs * CAPTURE_MAX_LOAD > NSEC_PER_SEC)
+		return -EINVAL;
+
+	mutex_lock(&mcp->captureLock);
+	stopCaptureLocked(mcp);
+	// The buffer is allocated on first use and kept until the module unloads
+	if (!kfifo_initialized(&mcp->captureFifo))
+		result = kfifo_alloc(&mcp->captureFifo, MCP23S08_CAPTURE_SAMPLES, GFP_KERNEL);
+	if (result == 0)
+	{
+		mutex_lock(&mcp->readLock);
+		kfifo_reset(&mcp->captureFifo);
+		mutex_unlock(&mcp->readLock);
+		mcp->captureOverruns = 0;
+		mcp->captureBurst = capture.burst;
+		mcp->captureWordNs = wordNs;
+		mcp->captureQueuedNs = 0;
+		mcp->capturePeriodNs = max_t(u64, div_u64((u64)capture.burst * NSEC_PER_SEC, capture.rate_hz), MCP23S08_MIN_DELAY_US * NSEC_PER_USEC);
+		hrtimer_start(&mcp->captureTimer, ns_to_ktime(mcp->capturePeriodNs), HRTIMER_MODE_REL);
+	}
+	mutex_unlock(&mcp->captureLock);
+	return result;
+}
+
+static struct mcp23s08Device* mcp23s08FromFile(struct file* file)
 {
+	// misc_open points private_data at the miscdevice
+	return container_of(file->private_data, struct mcp23s08Device, miscDevice);
+}
+
+// Returns whole samples, blocks until there is at least one unless O_NONBLOCK
+static ssize_t mcp23s08Read(struct file* file, char __user* buffer, size_t count, loff_t* offset)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromFile(file);
+	unsigned int copied;
 	int result;
 
-	printk(KERN_INFO "MCP23S08 driver: starting\n");
+	if (count < sizeof(struct mcp23s08_sample))
+		return -EINVAL;
+	if (kfifo_is_empty(&mcp->captureFifo))
+	{
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(mcp->captureWait, !kfifo_is_empty(&mcp->captureFifo)))
+			return -ERESTARTSYS;
+	}
+
+	if (mutex_lock_interruptible(&mcp->readLock))
+		return -ERESTARTSYS;
+	result = kfifo_to_user(&mcp->captureFifo, buffer, count, &copied);
+	mutex_unlock(&mcp->readLock);
+	return result ? result : copied;
+}
+
+static __poll_t mcp23s08Poll(struct file* file, poll_table* wait)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromFile(file);
+	poll_wait(file, &mcp->captureWait, wait);
+	return kfifo_is_empty(&mcp->captureFifo) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static long mcp23s08Ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromFile(file);
+	uint8_t __user* user = (uint8_t __user*)arg;
+	uint8_t value;
+
+	if (cmd == MCP23S08_IOC_PLAY)
+		return startPlayback(mcp, (struct mcp23s08_playback __user*)arg);
+	if (cmd == MCP23S08_IOC_CAPTURE_START)
+		return startCapture(mcp, (struct mcp23s08_capture __user*)arg);
+	if (cmd == MCP23S08_IOC_CAPTURE_STOP)
+	{
+		stopCapture(mcp);
+		return 0;
+	}
+	if (cmd == MCP23S08_IOC_STOP)
+	{
+		mutex_lock(&mcp->playLock);
+		stopPlaybackLocked(mcp);
+		mutex_unlock(&mcp->playLock);
+		return 0;
+	}
+
+	if (cmd == MCP23S08_IOC_READ_PORT)
+		return put_user(readCachedMcp23s08(mcp, DATA_REG), user);
+
+	if (get_user(value, user))
+		return -EFAULT;
+	switch (cmd)
+	{
+		case MCP23S08_IOC_WRITE_PORT:
+			writeCachedMcp23s08(mcp, OLAT_REG, value);
+			break;
+		case MCP23S08_IOC_SET_MASK:
+			updatePortMcp23s08(mcp, 0, value, 0);
+			break;
+		case MCP23S08_IOC_CLEAR_MASK:
+			updatePortMcp23s08(mcp, value, 0, 0);
+			break;
+		case MCP23S08_IOC_TOGGLE_MASK:
+			updatePortMcp23s08(mcp, 0, 0, value);
+			break;
+		default:
+			return -ENOTTY;
+	}
+	return 0;
+}
+
+static const struct file_operations mcp23s08Fops =
+{
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = mcp23s08Ioctl,
+	.read = mcp23s08Read,
+	.poll = mcp23s08Poll,
+	.llseek = no_llseek
+};
+
+//-----------------------------------------------------------------------------
+// GPIO Chip
+//-----------------------------------------------------------------------------
+
+// The expander pins are also registered with gpiolib so the GPIO character
+// device (libgpiod) can use them. Bulk operations map to one SPI transaction.
+
+static int mcp23s08GpioGetDirection(struct gpio_chip* chip, unsigned int offset)
+{
+	// IODIR uses 1 for inputs like gpiolib does
+	return (readCachedMcp23s08(gpiochip_get_data(chip), DIR_REG) >> offset) & 1;
+}
+
+static int mcp23s08GpioDirectionInput(struct gpio_chip* chip, unsigned int offset)
+{
+	updateBitMcp23s08(gpiochip_get_data(chip), DIR_REG, offset, 1);
+	return 0;
+}
+
+static int mcp23s08GpioDirectionOutput(struct gpio_chip* chip, unsigned int offset, int value)
+{
+	struct mcp23s08Device* mcp = gpiochip_get_data(chip);
+	// Latch the level first so the pin does not glitch when it turns into an output
+	updateBitMcp23s08(mcp, OLAT_REG, offset, value ? 1 : 0);
+	updateBitMcp23s08(mcp, DIR_REG, offset, 0);
+	return 0;
+}
+
+static int mcp23s08GpioGet(struct gpio_chip* chip, unsigned int offset)
+{
+	return (readCachedMcp23s08(gpiochip_get_data(chip), DATA_REG) >> offset) & 1;
+}
+
+static int mcp23s08GpioGetMultiple(struct gpio_chip* chip, unsigned long* mask, unsigned long* bits)
+{
+	uint8_t value = readCachedMcp23s08(gpiochip_get_data(chip), DATA_REG);
+	*bits = (*bits & ~*mask) | (value & *mask);
+	return 0;
+}
+
+static void mcp23s08GpioSet(struct gpio_chip* chip, unsigned int offset, int value)
+{
+	updateBitMcp23s08(gpiochip_get_data(chip), OLAT_REG, offset, value ? 1 : 0);
+}
+
+static void mcp23s08GpioSetMultiple(struct gpio_chip* chip, unsigned long* mask, unsigned long* bits)
+{
+	updatePortMcp23s08(gpiochip_get_data(chip), *mask & ~*bits, *mask & *bits, 0);
+}
+
+// Interrupt on change, the GPINTEN, INTCON and DEFVAL writes are deferred
+// to irq_bus_sync_unlock since SPI transactions cannot happen in irq_mask
+
+static struct mcp23s08Device* mcp23s08FromIrqData(struct irq_data* data)
+{
+	return gpiochip_get_data(irq_data_get_irq_chip_data(data));
+}
 
-	// Create qe directory under /sys/kernel
-	kobj = kobject_create_and_add("spi_expander", kernel_kobj);
-	if (!kobj)
+static void mcp23s08IrqMask(struct irq_data* data)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromIrqData(data);
+	irq_hw_number_t hwirq = irqd_to_hwirq(data);
+	mcp->irqEnabled &= ~(1 << hwirq);
+	gpiochip_disable_irq(&mcp->gpioChip, hwirq);
+}
+
+static void mcp23s08IrqUnmask(struct irq_data* data)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromIrqData(data);
+	irq_hw_number_t hwirq = irqd_to_hwirq(data);
+	gpiochip_enable_irq(&mcp->gpioChip, hwirq);
+	mcp->irqEnabled |= 1 << hwirq;
+}
+
+static int mcp23s08IrqSetType(struct irq_data* data, unsigned int type)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromIrqData(data);
+	uint8_t bit = 1 << irqd_to_hwirq(data);
+	switch (type)
+	{
+		case IRQ_TYPE_EDGE_BOTH:
+			mcp->irqRise |= bit;
+			mcp->irqFall |= bit;
+			mcp->irqIntcon &= ~bit;
+			break;
+		case IRQ_TYPE_EDGE_RISING:
+			mcp->irqRise |= bit;
+			mcp->irqFall &= ~bit;
+			mcp->irqIntcon &= ~bit;
+			break;
+		case IRQ_TYPE_EDGE_FALLING:
+			mcp->irqRise &= ~bit;
+			mcp->irqFall |= bit;
+			mcp->irqIntcon &= ~bit;
+			break;
+		case IRQ_TYPE_LEVEL_HIGH:
+			mcp->irqIntcon |= bit;
+			mcp->irqDefval &= ~bit;
+			break;
+		case IRQ_TYPE_LEVEL_LOW:
+			mcp->irqIntcon |= bit;
+			mcp->irqDefval |= bit;
+			break;
+		default:
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static void mcp23s08IrqBusLock(struct irq_data* data)
+{
+	mutex_lock(&mcp23s08FromIrqData(data)->irqLock);
+}
+
+static void mcp23s08IrqBusSyncUnlock(struct irq_data* data)
+{
+	struct mcp23s08Device* mcp = mcp23s08FromIrqData(data);
+	writeCachedMcp23s08(mcp, DEFVAL_REG, mcp->irqDefval);
+	writeCachedMcp23s08(mcp, INTCON_REG, mcp->irqIntcon);
+	writeCachedMcp23s08(mcp, GPINTEN_REG, mcp->irqEnabled);
+	mutex_unlock(&mcp->irqLock);
+}
+
+// Shared by every device, gpiolib leaves an immutable irq_chip alone and the
+// mask and unmask callbacks tell it which pins are in use as interrupts
+static const struct irq_chip mcp23s08IrqChip =
+{
+	.name = "mcp23s08",
+	.irq_mask = mcp23s08IrqMask,
+	.irq_unmask = mcp23s08IrqUnmask,
+	.irq_set_type = mcp23s08IrqSetType,
+	.irq_bus_lock = mcp23s08IrqBusLock,
+	.irq_bus_sync_unlock = mcp23s08IrqBusSyncUnlock,
+	.flags = IRQCHIP_IMMUTABLE,
+	GPIOCHIP_IRQ_RESOURCE_HELPERS
+};
+
+// INTF tells which pins interrupted, INTCAP holds the port when it happened.
+// Reading INTCAP releases the INT pin.
+static irqreturn_t mcp23s08IntThread(int irq, void* data)
+{
+	struct mcp23s08Device* mcp = data;
+	unsigned long pending;
+	uint8_t intf, intcap;
+	unsigned int pin;
+
+	claimBus();
+	intf = readRegisterMcp23s08(mcp, INTF_REG) & 0xFF;
+	intcap = readRegisterMcp23s08(mcp, INTCAP_REG) & 0xFF;
+	releaseBus();
+
+	// Changes are reported on both edges, only keep the requested ones
+	pending = intf & mcp->irqEnabled & (mcp->irqIntcon | (mcp->irqRise & intcap) | (mcp->irqFall & ~intcap));
+	for_each_set_bit(pin, &pending, 8)
+		handle_nested_irq(irq_find_mapping(mcp->gpioChip.irq.domain, pin));
+
+	return intf ? IRQ_HANDLED : IRQ_NONE;
+}
+
+static const struct gpio_chip mcp23s08GpioChip =
+{
+	.owner = THIS_MODULE,
+	.base = -1,
+	.ngpio = 8,
+	// Transactions take busMutex
+	.can_sleep = true,
+	.get_direction = mcp23s08GpioGetDirection,
+	.direction_input = mcp23s08GpioDirectionInput,
+	.direction_output = mcp23s08GpioDirectionOutput,
+	.get = mcp23s08GpioGet,
+	.get_multiple = mcp23s08GpioGetMultiple,
+	.set = mcp23s08GpioSet,
+	.set_multiple = mcp23s08GpioSetMultiple
+};
+
+//-----------------------------------------------------------------------------
+// Initialization and Exit
+//-----------------------------------------------------------------------------
+
+// Fills devices from the expanders parameter, one expander at 0:0 when it is empty
+static int parseExpanders(void)
+{
+	unsigned int cs, address;
+	int i, j;
+
+	if (expanderCount == 0)
+	{
+		devices[0].cs = 0;
+		devices[0].address = 0;
+		deviceCount = 1;
+		return 0;
+	}
+
+	for (i = 0; i < expanderCount; i++)
+	{
+		if (sscanf(expanders[i], "%u:%u", &cs, &address) != 2 || cs >= CS_COUNT || address >= ADDRESSES_PER_CS)
+		{
+			printk(KERN_ALERT "MCP23S08 driver: invalid expander %s, expected cs:address\n", expanders[i]);
+			return -EINVAL;
+		}
+		for (j = 0; j < i; j++)
+		{
+			if (devices[j].cs == cs && devices[j].address == address)
+			{
+				printk(KERN_ALERT "MCP23S08 driver: expander %s listed twice\n", expanders[i]);
+				return -EINVAL;
+			}
+		}
+		devices[i].cs = cs;
+		devices[i].address = address;
+	}
+	deviceCount = expanderCount;
+	return 0;
+}
+
+static void unregisterMcp23s08(struct mcp23s08Device* mcp)
+{
+	mutex_lock(&mcp->playLock);
+	stopPlaybackLocked(mcp);
+	mutex_unlock(&mcp->playLock);
+	stopCapture(mcp);
+	// The PWM timer would otherwise fire into the unloaded module
+	mutex_lock(&mcp->pwmLock);
+	hrtimer_cancel(&mcp->pwmTimer);
+	mutex_unlock(&mcp->pwmLock);
+	if (mcp->intGpio >= 0)
+	{
+		free_irq(mcp->intIrq, mcp);
+		gpio_free(mcp->intGpio);
+	}
+	gpiochip_remove(&mcp->gpioChip);
+	misc_deregister(&mcp->miscDevice);
+	kobject_put(mcp->kobj);
+	if (kfifo_initialized(&mcp->captureFifo))
+		kfifo_free(&mcp->captureFifo);
+}
+
+// Creates the sysfs directory, misc device and gpio chip of one expander
+static int registerMcp23s08(struct mcp23s08Device* mcp, unsigned int index)
+{
+	int result;
+	int i;
+
+	if (index == 0)
+	{
+		strcpy(mcp->name, "spi_expander");
+		strcpy(mcp->label, "mcp23s08");
+	}
+	else
+	{
+		snprintf(mcp->name, sizeof(mcp->name), "spi_expander%u", index);
+		snprintf(mcp->label, sizeof(mcp->label), "mcp23s08-%u", index);
+	}
+	mcp->intGpio = int_gpio[index];
+	mutex_init(&mcp->irqLock);
+	mutex_init(&mcp->playLock);
+	hrtimer_init(&mcp->playTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	mcp->playTimer.function = playTimerHandler;
+	mutex_init(&mcp->captureLock);
+	mutex_init(&mcp->readLock);
+	init_waitqueue_head(&mcp->captureWait);
+	hrtimer_init(&mcp->captureTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mcp->captureTimer.function = captureTimerHandler;
+	mutex_init(&mcp->pwmLock);
+	hrtimer_init(&mcp->pwmTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	mcp->pwmTimer.function = pwmTimerHandler;
+
+	mcp->kobj = kobject_create_and_add(mcp->name, kernel_kobj);
+	if (!mcp->kobj)
 	{
 		printk(KERN_ALERT "MCP23S08 Driver: failed to create and add kobj\n");
 		return -ENOENT;
 	}
 
-	result = sysfs_create_group(kobj, &group0);
+	result = sysfs_create_groups(mcp->kobj, groups);
+	// Create a file for each attribute
+	for (i = 0; result == 0 && attrs[i] != NULL; i++)
+		result = sysfs_create_file(mcp->kobj, attrs[i]);
+	if (result == 0 && index == 0)
+		result = sysfs_create_file(mcp->kobj, &portsAttr.attr);
 	if (result != 0)
-		return result;
+		goto putKobj;
 
-	result = sysfs_create_group(kobj, &group1);
+	mcp->miscDevice.minor = MISC_DYNAMIC_MINOR;
+	mcp->miscDevice.name = mcp->name;
+	mcp->miscDevice.fops = &mcp23s08Fops;
+	mcp->miscDevice.mode = 0660;
+	result = misc_register(&mcp->miscDevice);
 	if (result != 0)
-		return result;
+	{
+		printk(KERN_ALERT "MCP23S08 driver: failed to register /dev/%s\n", mcp->name);
+		goto putKobj;
+	}
 
-	result = sysfs_create_group(kobj, &group2);
-	if (result != 0)
-		return result;
+	mcp->gpioChip = mcp23s08GpioChip;
+	mcp->gpioChip.label = mcp->label;
+	// Pins can only interrupt when the INT pin is wired
+	if (mcp->intGpio >= 0)
+	{
+		struct gpio_irq_chip* girq = &mcp->gpioChip.irq;
+		gpio_irq_chip_set_chip(girq, &mcp23s08IrqChip);
+		girq->parent_handler = NULL;
+		girq->num_parents = 0;
+		girq->parents = NULL;
+		girq->default_type = IRQ_TYPE_NONE;
+		girq->handler = handle_simple_irq;
+		girq->threaded = true;
+	}
 
-	result = sysfs_create_group(kobj, &group3);
+	result = gpiochip_add_data(&mcp->gpioChip, mcp);
 	if (result != 0)
-		return result;
+	{
+		printk(KERN_ALERT "MCP23S08 driver: failed to add gpio chip\n");
+		goto deregisterMisc;
+	}
 
-	result = sysfs_create_group(kobj, &group4);
-	if (result != 0)
-		return result;
+	if (mcp->intGpio >= 0)
+	{
+		result = gpio_request_one(mcp->intGpio, GPIOF_IN, mcp->label);
+		if (result == 0)
+		{
+			// Drop anything captured before the interrupt was requested
+			claimBus();
+			readRegisterMcp23s08(mcp, INTCAP_REG);
+			releaseBus();
+			mcp->intIrq = gpio_to_irq(mcp->intGpio);
+			// INT is active low and stays low until INTCAP is read
+			result = request_threaded_irq(mcp->intIrq, NULL, mcp23s08IntThread, IRQF_TRIGGER_FALLING | IRQF_ONESHOT, mcp->label, mcp);
+			if (result != 0)
+				gpio_free(mcp->intGpio);
+		}
+		if (result != 0)
+		{
+			printk(KERN_ALERT "MCP23S08 driver: failed to request INT gpio %d\n", mcp->intGpio);
+			gpiochip_remove(&mcp->gpioChip);
+			goto deregisterMisc;
+		}
+	}
 
-	result = sysfs_create_group(kobj, &group5);
-	if (result != 0)
-		return result;
+	return 0;
 
-	result = sysfs_create_group(kobj, &group6);
-	if (result != 0)
-		return result;
+deregisterMisc:
+	misc_deregister(&mcp->miscDevice);
+putKobj:
+	kobject_put(mcp->kobj);
+	return result;
+}
 
-	result = sysfs_create_group(kobj, &group7);
-	if (result != 0)
-		return result;
+// The expanders hang off one SPI IP instance, any other instance is left alone
+static int mcp23s08Probe(struct platform_device* pdev)
+{
+	uint8_t csMask = 0;
+	int result;
+	int i;
+
+	if (base != NULL)
+		return -EBUSY;
 
 	// Physical to virtual memory map to access spi registers
-	base = (unsigned int*)ioremap_nocache(LW_BRIDGE_BASE + SPI_BASE_OFFSET, SPAN_IN_BYTES);
-	if (base == NULL)
-		return -ENODEV;
+	base = (unsigned int*)devm_platform_ioremap_resource(pdev, 0);
+	if (IS_ERR(base))
+	{
+		result = PTR_ERR(base);
+		base = NULL;
+		return result;
+	}
+
+	// Statistics are optional, debugfs failures are not fatal
+	debugfsDir = debugfs_create_dir("spi_expander", NULL);
+	for (i = 0; i < CS_COUNT; i++)
+	{
+		char name[8];
+		snprintf(name, sizeof(name), "cs%d", i);
+		debugfs_create_file(name, 0444, debugfsDir, &stats[i], &spiStats_fops);
+	}
 
 	// Baud Rate = 5MHz
 	spiSetBaudRate(5e6);
-	// Set device 0 in SPI mode 0, 0
-	spiCsSelect(0);
-	spiSetMode(0, 0);
-	spiCsAutoEnable(0);
+	// Every chip select with an expander runs in SPI mode 0, 0
+	for (i = 0; i < deviceCount; i++)
+		csMask |= 1 << devices[i].cs;
+	for (i = 0; i < CS_COUNT; i++)
+	{
+		if (csMask & (1 << i))
+		{
+			spiSetMode(i, 0);
+			spiCsAutoEnable(i);
+		}
+	}
+	spiCsSelect(devices[0].cs);
+	currentCs = devices[0].cs;
 	// Set the word size as 24 bits
 	setWordSize(23);
 	spiEnable();
 
-	printk(KERN_INFO "MCP23S08 driver: initialized\n");
+	enableHardwareAddressMcp23s08();
+
+	for (i = 0; i < deviceCount; i++)
+	{
+		result = registerMcp23s08(&devices[i], i);
+		if (result != 0)
+		{
+			while (--i >= 0)
+				unregisterMcp23s08(&devices[i]);
+			spiDisable();
+			debugfs_remove_recursive(debugfsDir);
+			base = NULL;
+			return result;
+		}
+	}
+
+	printk(KERN_INFO "MCP23S08 driver: initialized %u expanders\n", deviceCount);
 
 	return 0;
 }
 
-static void __exit exit_module(void)
+static int mcp23s08Remove(struct platform_device* pdev)
 {
+	int i;
+	for (i = deviceCount - 1; i >= 0; i--)
+		unregisterMcp23s08(&devices[i]);
 	spiDisable();
-	kobject_put(kobj);
+	debugfs_remove_recursive(debugfsDir);
+	base = NULL;
+	return 0;
+}
+
+// Binds the same node as spi_driver, only one of the two modules is loaded.
+// There is no MODULE_DEVICE_TABLE so udev never loads this one on its own.
+static const struct of_device_id mcp23s08OfMatch[] =
+{
+	{ .compatible = "jlosh,spi0-1.0" },
+	{ }
+};
+
+static struct platform_driver mcp23s08PlatformDriver =
+{
+	.probe = mcp23s08Probe,
+	.remove = mcp23s08Remove,
+	.driver =
+	{
+		.name = "mcp23s08_spi_ip",
+		.of_match_table = mcp23s08OfMatch
+	}
+};
+
+static int __init initialize_module(void)
+{
+	int result;
+
+	printk(KERN_INFO "MCP23S08 driver: starting\n");
+
+	result = parseExpanders();
+	if (result != 0)
+		return result;
+
+	result = platform_driver_register(&mcp23s08PlatformDriver);
+	if (result != 0)
+	{
+		printk(KERN_ALERT "MCP23S08 driver: failed to register platform driver\n");
+		return result;
+	}
+
+	return 0;
+}
+
+static void __exit exit_module(void)
+{
+	platform_driver_unregister(&mcp23s08PlatformDriver);
 	printk(KERN_INFO "MCP23S08 driver: exit\n");
 }
 
@@ -0,0 +1,75 @@
+#ifndef MCP23S08_IOCTL_H_
+#define MCP23S08_IOCTL_H_
+
+// ioctls of /dev/spi_expander
+// Each port ioctl is a single SPI transaction on the whole 8-bit port.
+// The argument points to the port value or the mask of pins to change.
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MCP23S08_IOC_MAGIC			'm'
+
+// Reads GPIO
+#define MCP23S08_IOC_READ_PORT		_IOR(MCP23S08_IOC_MAGIC, 0, __u8)
+// Writes OLAT
+#define MCP23S08_IOC_WRITE_PORT		_IOW(MCP23S08_IOC_MAGIC, 1, __u8)
+// Drives the pins in the mask high, leaves the others alone
+#define MCP23S08_IOC_SET_MASK		_IOW(MCP23S08_IOC_MAGIC, 2, __u8)
+// Drives the pins in the mask low, leaves the others alone
+#define MCP23S08_IOC_CLEAR_MASK		_IOW(MCP23S08_IOC_MAGIC, 3, __u8)
+// Inverts the pins in the mask, leaves the others alone
+#define MCP23S08_IOC_TOGGLE_MASK	_IOW(MCP23S08_IOC_MAGIC, 4, __u8)
+
+// Pattern playback, OLAT takes each value in turn and holds it for delay_us
+struct mcp23s08_step
+{
+	__u8 value;
+	__u8 reserved[3];
+	__u32 delay_us;
+};
+
+#define MCP23S08_MAX_STEPS			4096
+#define MCP23S08_MIN_DELAY_US		10
+
+struct mcp23s08_playback
+{
+	// Pointer to count steps
+	__u64 steps;
+	__u32 count;
+	// Passes over the steps, 0 repeats until stopped
+	__u32 loops;
+};
+
+// Starts playing in the background, replacing any pattern already playing
+#define MCP23S08_IOC_PLAY			_IOW(MCP23S08_IOC_MAGIC, 5, struct mcp23s08_playback)
+// Stops playback, OLAT keeps the last value played
+#define MCP23S08_IOC_STOP			_IO(MCP23S08_IOC_MAGIC, 6)
+
+// Input capture, samples are read from the device as struct mcp23s08_sample
+struct mcp23s08_sample
+{
+	// CLOCK_MONOTONIC, estimated from when the read was queued and the word
+	// time at the current baud rate, not measured per sample
+	__u64 timestamp_ns;
+	__u8 value;
+	__u8 reserved[7];
+};
+
+#define MCP23S08_CAPTURE_SAMPLES	4096
+#define MCP23S08_MAX_CAPTURE_HZ		200000
+
+// rate_hz is refused when the reads would keep the bus busy over half the time
+struct mcp23s08_capture
+{
+	__u32 rate_hz;
+	// Reads queued back to back each timer tick, up to the FIFO depth
+	__u32 burst;
+};
+
+// Empties the capture buffer and starts sampling GPIO
+#define MCP23S08_IOC_CAPTURE_START	_IOW(MCP23S08_IOC_MAGIC, 7, struct mcp23s08_capture)
+// Stops sampling, samples already captured can still be read
+#define MCP23S08_IOC_CAPTURE_STOP	_IO(MCP23S08_IOC_MAGIC, 8)
+
+#endif
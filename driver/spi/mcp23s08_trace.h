@@ -0,0 +1,71 @@
+// MCP23S08 tracepoints
+// Sarker Nadir Afridi Azmi
+
+// Every register access goes through submit, first word written,
+// last word received and complete. Enable them with
+//   echo 1 > /sys/kernel/debug/tracing/events/mcp23s08/enable
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mcp23s08
+
+#if !defined(MCP23S08_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define MCP23S08_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(mcp23s08_access,
+	TP_PROTO(unsigned int cs, uint8_t reg, uint32_t word),
+	TP_ARGS(cs, reg, word),
+	TP_STRUCT__entry(
+		__field(unsigned int, cs)
+		__field(uint8_t, reg)
+		__field(uint32_t, word)
+	),
+	TP_fast_assign(
+		__entry->cs = cs;
+		__entry->reg = reg;
+		__entry->word = word;
+	),
+	TP_printk("cs=%u reg=0x%02x word=0x%06x", __entry->cs, __entry->reg, __entry->word)
+);
+
+DEFINE_EVENT(mcp23s08_access, mcp23s08_submit,
+	TP_PROTO(unsigned int cs, uint8_t reg, uint32_t word),
+	TP_ARGS(cs, reg, word)
+);
+
+DEFINE_EVENT(mcp23s08_access, mcp23s08_first_word,
+	TP_PROTO(unsigned int cs, uint8_t reg, uint32_t word),
+	TP_ARGS(cs, reg, word)
+);
+
+DEFINE_EVENT(mcp23s08_access, mcp23s08_last_word,
+	TP_PROTO(unsigned int cs, uint8_t reg, uint32_t word),
+	TP_ARGS(cs, reg, word)
+);
+
+TRACE_EVENT(mcp23s08_complete,
+	TP_PROTO(unsigned int cs, uint8_t reg, unsigned int pollSpins, u64 latencyNs),
+	TP_ARGS(cs, reg, pollSpins, latencyNs),
+	TP_STRUCT__entry(
+		__field(unsigned int, cs)
+		__field(uint8_t, reg)
+		__field(unsigned int, pollSpins)
+		__field(u64, latencyNs)
+	),
+	TP_fast_assign(
+		__entry->cs = cs;
+		__entry->reg = reg;
+		__entry->pollSpins = pollSpins;
+		__entry->latencyNs = latencyNs;
+	),
+	TP_printk("cs=%u reg=0x%02x poll_spins=%u latency_ns=%llu",
+		__entry->cs, __entry->reg, __entry->pollSpins, __entry->latencyNs)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE mcp23s08_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,254 @@
+// Author: Sarker Nadir Afridi Azmi
+
+// Includes, Defines
+
+#include <pthread.h>
+#include <unistd.h>
+#include "spi_ip.h"
+#include "spi_async.h"
+
+// Global variables
+
+// Requests waiting for the I/O thread, oldest first
+static spiRequest* queueHead = NULL;
+static spiRequest* queueTail = NULL;
+static bool stopping = false;
+static bool running = false;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+// Signalled whenever requests complete, for spiWaitDone
+static pthread_cond_t requestDone = PTHREAD_COND_INITIALIZER;
+static pthread_t ioThread;
+// Set after a failure until the FIFOs are known to be empty again
+static bool needResync = false;
+
+// Subroutines
+
+// Words of two requests can share the FIFO when nothing about the core
+// changes between them. Manual CS frames the request, so it never shares.
+static bool canStream(const spiRequest* a, const spiRequest* b)
+{
+	return a->csAuto && b->csAuto && a->cs == b->cs && a->mode == b->mode && a->wordSize == b->wordSize;
+}
+
+// Once done is set the submitter may reuse the request, so everything needed
+// afterwards is copied out first
+static void complete(spiRequest* request)
+{
+	spiCallback callback = request->callback;
+	void* context = request->context;
+	int eventFd = request->eventFd;
+	uint64_t one = 1;
+
+	if (!request->csAuto)
+		enableCS(request->cs);
+	pthread_mutex_lock(&queueLock);
+	request->done = true;
+	pthread_cond_broadcast(&requestDone);
+	pthread_mutex_unlock(&queueLock);
+	if (eventFd >= 0)
+		write(eventFd, &one, sizeof(one));
+	if (callback != NULL)
+		callback(request, context);
+}
+
+// Fails every request from request up to but not including end
+static void failRequests(spiRequest* request, const spiRequest* end)
+{
+	while (request != end)
+	{
+		spiRequest* failed = request;
+		request = request->next;
+		failed->failed = true;
+		complete(failed);
+	}
+}
+
+// The engine counts on nothing being in flight between requests. Waits for
+// words left over from a failure to shift out, throws every reply away and
+// clears the overflow flags. Returns false when tx_fifo does not drain.
+static bool resync()
+{
+	while (!(spiReadRegister(OFS_STATUS) & STATUS_TXFE))
+	{
+		if (!spiWaitReply() && !(spiReadRegister(OFS_STATUS) & STATUS_TXFE))
+			return false;
+		while (!(spiReadRegister(OFS_STATUS) & STATUS_RXFE))
+			spiReadData();
+	}
+	while (!(spiReadRegister(OFS_STATUS) & STATUS_RXFE))
+		spiReadData();
+	spiWriteRegister(OFS_STATUS, STATUS_TXFO | STATUS_RXFO);
+	needResync = false;
+	return true;
+}
+
+// Runs a list of requests in order. Words are sent while fewer than FIFO_DEPTH
+// are in flight, like spiTransfer, and replies are handed back to the request
+// they belong to as they arrive. The core is only reconfigured once everything
+// before the next request has finished. When a reply goes missing there is no
+// telling which word it belonged to, so every request with words in flight
+// fails and the rest start over once the FIFOs have been resynced. When they
+// cannot be, the rest fail as well.
+static void runRequests(spiRequest* first)
+{
+	spiRequest* sendRequest = first;
+	spiRequest* receiveRequest = first;
+	// Copy of the request the core was last set up for
+	spiRequest configured = { .csAuto = false };
+	uint32_t sendIndex = 0;
+	uint32_t receiveIndex = 0;
+	uint32_t inFlight = 0;
+
+	spiLock();
+	if (needResync && !resync())
+	{
+		failRequests(first, NULL);
+		spiUnlock();
+		return;
+	}
+	while (receiveRequest != NULL)
+	{
+		uint32_t level = rxFifoLevel(spiReadRegister(OFS_STATUS));
+		inFlight -= level;
+		while (level-- > 0)
+		{
+			uint32_t data = spiReadData();
+			if (receiveRequest->rx != NULL)
+				receiveRequest->rx[receiveIndex] = data;
+			receiveIndex++;
+			// An empty request is only finished here once it has been sent,
+			// else the send loop below would still act on it after completion
+			while (receiveRequest != NULL && receiveIndex == receiveRequest->n && receiveRequest != sendRequest)
+			{
+				spiRequest* done = receiveRequest;
+				receiveRequest = receiveRequest->next;
+				receiveIndex = 0;
+				complete(done);
+			}
+		}
+		// Requests with nothing to send finish as soon as they are reached
+		while (receiveRequest != NULL && receiveRequest == sendRequest && inFlight == 0 && receiveRequest->n == 0)
+		{
+			spiRequest* done = receiveRequest;
+			sendRequest = receiveRequest = receiveRequest->next;
+			complete(done);
+		}
+
+		bool sent = false;
+		while (sendRequest != NULL && inFlight < FIFO_DEPTH)
+		{
+			if (sendIndex == 0)
+			{
+				if (!canStream(&configured, sendRequest))
+				{
+					if (inFlight > 0)
+						break;
+					spiConfigure(sendRequest->cs, sendRequest->mode, sendRequest->wordSize, sendRequest->csAuto);
+					if (!sendRequest->csAuto)
+						disableCS(sendRequest->cs);
+				}
+				configured = *sendRequest;
+			}
+			if (sendRequest->n > 0)
+			{
+				spiWriteData(sendRequest->tx[sendIndex++]);
+				inFlight++;
+				sent = true;
+			}
+			if (sendIndex == sendRequest->n)
+			{
+				sendRequest = sendRequest->next;
+				sendIndex = 0;
+			}
+		}
+		if (!sent && inFlight > 0 && !spiWaitReply())
+		{
+			spiRequest* next = sendIndex > 0 ? sendRequest->next : sendRequest;
+			failRequests(receiveRequest, next);
+			needResync = true;
+			if (!resync())
+			{
+				failRequests(next, NULL);
+				next = NULL;
+			}
+			sendRequest = receiveRequest = next;
+			sendIndex = receiveIndex = 0;
+			inFlight = 0;
+			configured.csAuto = false;
+		}
+	}
+	spiUnlock();
+}
+
+static void* ioThreadMain(void* argument)
+{
+	pthread_mutex_lock(&queueLock);
+	while (true)
+	{
+		while (queueHead == NULL && !stopping)
+			pthread_cond_wait(&queueReady, &queueLock);
+		if (queueHead == NULL)
+			break;
+		// Everything queued so far is taken in one go
+		spiRequest* requests = queueHead;
+		queueHead = queueTail = NULL;
+		pthread_mutex_unlock(&queueLock);
+		runRequests(requests);
+		pthread_mutex_lock(&queueLock);
+	}
+	pthread_mutex_unlock(&queueLock);
+	return NULL;
+}
+
+bool spiAsyncStart()
+{
+	if (running)
+		return true;
+	stopping = false;
+	running = pthread_create(&ioThread, NULL, ioThreadMain, NULL) == 0;
+	return running;
+}
+
+void spiAsyncStop()
+{
+	if (!running)
+		return;
+	pthread_mutex_lock(&queueLock);
+	stopping = true;
+	pthread_cond_signal(&queueReady);
+	pthread_mutex_unlock(&queueLock);
+	pthread_join(ioThread, NULL);
+	running = false;
+}
+
+bool spiSubmit(spiRequest* request)
+{
+	if (!running || request->cs > 3 || request->mode > 3 || request->wordSize < 1 || request->wordSize > 32)
+		return false;
+	request->done = false;
+	request->failed = false;
+	request->next = NULL;
+	pthread_mutex_lock(&queueLock);
+	if (queueTail != NULL)
+		queueTail->next = request;
+	else
+		queueHead = request;
+	queueTail = request;
+	pthread_cond_signal(&queueReady);
+	pthread_mutex_unlock(&queueLock);
+	return true;
+}
+
+bool spiIsDone(const spiRequest* request)
+{
+	return request->done;
+}
+
+void spiWaitDone(spiRequest* request)
+{
+	pthread_mutex_lock(&queueLock);
+	while (!request->done)
+		pthread_cond_wait(&requestDone, &queueLock);
+	pthread_mutex_unlock(&queueLock);
+}
@@ -0,0 +1,54 @@
+// Author: Sarker Nadir Afridi Azmi
+
+// Asynchronous transactions on top of spi_ip
+// One I/O thread owns the FIFOs. Requests are queued with spiSubmit, which
+// returns at once, and requests that share a configuration are streamed back
+// to back so the FIFOs stay full across them. Completion is reported through
+// the request's callback, its eventfd, or by polling or waiting on it.
+
+#ifndef SPI_ASYNC_H_
+#define SPI_ASYNC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct _spiRequest spiRequest;
+typedef void (*spiCallback)(spiRequest* request, void* context);
+
+// The request is the handle, it must stay valid until it completes
+struct _spiRequest
+{
+	uint8_t cs;
+	uint8_t mode;
+	// Bits per word, 1 to 32
+	uint8_t wordSize;
+	// false holds CS low over the whole request
+	bool csAuto;
+	const uint32_t* tx;
+	// NULL discards the replies
+	uint32_t* rx;
+	uint32_t n;
+
+	// Called from the I/O thread with the bus locked, so keep it short. May be NULL
+	spiCallback callback;
+	void* context;
+	// Written with 1 on completion, -1 for none
+	int eventFd;
+
+	// Owned by the engine. failed is set along with done when replies were
+	// lost or never came, rx then holds nothing useful.
+	volatile bool done;
+	volatile bool failed;
+	spiRequest* next;
+};
+
+// Starts the I/O thread, the core must already be open
+bool spiAsyncStart();
+// Finishes every queued request, then stops the I/O thread
+void spiAsyncStop();
+
+bool spiSubmit(spiRequest* request);
+bool spiIsDone(const spiRequest* request);
+void spiWaitDone(spiRequest* request);
+
+#endif
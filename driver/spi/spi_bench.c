@@ -0,0 +1,370 @@
+// Author: Sarker Nadir Afridi Azmi
+
+// Throughput and latency benchmark for the SPI IP core
+// Sweeps baud rate, word size, CS mode and transfer API. Each run performs a
+// number of operations that each move a batch of words, and prints one CSV
+// line with words/s, bits/s against the wire rate and operation latency
+// percentiles. Nothing needs to be attached to the bus, replies are discarded.
+// Backends with their own clock, the model with SPI_MODEL_CYCLES set or the
+// co-simulation, are timed in their clock cycles instead of wall time, so the
+// figures are those of the core and not of the host simulating it. The clock
+// column tells which one a line was timed with.
+
+// Includes, Defines
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include "spi_ip.h"
+#include "spi_async.h"
+
+#define CLOCK_FREQUENCY		50000000
+#define MAX_SWEEP			16
+#define DEFAULT_OPERATIONS	1000
+#define DEFAULT_BATCH		16
+
+typedef enum _benchApi
+{
+	API_WORD,
+	API_TRANSFER,
+	API_SEGMENTS,
+	API_ASYNC,
+	API_COUNT
+} benchApi;
+
+static const char* apiNames[API_COUNT] = { "word", "transfer", "segments", "async" };
+
+// Global variables
+
+static uint32_t baudRates[MAX_SWEEP] = { 1000000, 2000000, 5000000, 10000000, 12500000, 25000000 };
+static uint32_t baudRateCount = 6;
+static uint32_t wordSizes[MAX_SWEEP] = { 8, 16, 32 };
+static uint32_t wordSizeCount = 3;
+static bool apiEnabled[API_COUNT] = { true, true, true, true };
+static uint8_t cs = 0;
+static uint32_t operations = DEFAULT_OPERATIONS;
+static uint32_t batch = DEFAULT_BATCH;
+
+static uint32_t* tx;
+static uint32_t* rx;
+// Duration of every operation of the current run in ns
+static uint64_t* latencies;
+// Time is taken from spiBackendCycles, see spiBackendSimulated
+static bool simulated = false;
+
+// Subroutines
+
+static uint64_t nowNs()
+{
+	if (simulated)
+		return spiBackendCycles() * 1000000000ULL / CLOCK_FREQUENCY;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compareLatency(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of the sorted latencies, p in parts per thousand
+static uint64_t percentile(uint32_t p)
+{
+	uint64_t rank = ((uint64_t)p * operations + 999) / 1000;
+	return latencies[rank > 0 ? rank - 1 : 0];
+}
+
+// Throws away replies left over from an earlier run
+static void drainRx()
+{
+	spiWaitTxEmpty();
+	while (!(spiReadRegister(OFS_STATUS) & STATUS_RXFE))
+		spiReadData();
+}
+
+// One word at a time, waiting for each reply before sending the next.
+// The runs return false as soon as a word goes unanswered.
+static bool runWord(bool csAuto)
+{
+	uint32_t i, j;
+	bool ok = true;
+	for (i = 0; ok && i < operations; i++)
+	{
+		uint64_t start = nowNs();
+		spiLock();
+		if (!csAuto)
+			disableCS(cs);
+		for (j = 0; ok && j < batch; j++)
+		{
+			spiWriteData(tx[j]);
+			ok = spiWaitReply();
+			if (ok)
+				rx[j] = spiReadData();
+		}
+		if (!csAuto)
+			enableCS(cs);
+		spiUnlock();
+		latencies[i] = nowNs() - start;
+	}
+	return ok;
+}
+
+static bool runTransfer(bool csAuto)
+{
+	uint32_t i;
+	bool ok = true;
+	for (i = 0; ok && i < operations; i++)
+	{
+		uint64_t start = nowNs();
+		spiLock();
+		if (!csAuto)
+			disableCS(cs);
+		ok = spiTransfer(tx, rx, batch);
+		if (!csAuto)
+			enableCS(cs);
+		spiUnlock();
+		latencies[i] = nowNs() - start;
+	}
+	return ok;
+}
+
+static bool runSegments(uint8_t wordSize, bool csAuto)
+{
+	spiSegment segment = { .cs = cs, .mode = 0, .wordSize = wordSize, .csAuto = csAuto, .tx = tx, .rx = rx, .n = batch };
+	uint32_t i;
+	bool ok = true;
+	for (i = 0; ok && i < operations; i++)
+	{
+		uint64_t start = nowNs();
+		ok = spiTransferSegments(&segment, 1);
+		latencies[i] = nowNs() - start;
+	}
+	return ok;
+}
+
+// Callbacks run after a request is marked done, so they are counted as well
+static uint32_t asyncCompleted;
+
+// Completion time of each request, the latency is measured from submission
+static void asyncDone(spiRequest* request, void* context)
+{
+	*(uint64_t*)context = nowNs();
+	__atomic_add_fetch(&asyncCompleted, 1, __ATOMIC_RELEASE);
+}
+
+// Every operation is queued up front so the engine can stream them
+static bool runAsync(uint8_t wordSize, bool csAuto)
+{
+	spiRequest* requests = calloc(operations, sizeof(spiRequest));
+	uint64_t* submitted = calloc(operations, sizeof(uint64_t));
+	uint32_t i;
+	bool ok = requests != NULL && submitted != NULL;
+	asyncCompleted = 0;
+	for (i = 0; ok && i < operations; i++)
+	{
+		requests[i] = (spiRequest){ .cs = cs, .mode = 0, .wordSize = wordSize, .csAuto = csAuto, .tx = tx, .rx = rx, .n = batch,
+			.callback = asyncDone, .context = &latencies[i], .eventFd = -1 };
+		submitted[i] = nowNs();
+		ok = spiSubmit(&requests[i]);
+	}
+	if (ok)
+	{
+		spiWaitDone(&requests[operations - 1]);
+		while (__atomic_load_n(&asyncCompleted, __ATOMIC_ACQUIRE) != operations)
+			sched_yield();
+		for (i = 0; i < operations; i++)
+		{
+			latencies[i] -= submitted[i];
+			ok = ok && !requests[i].failed;
+		}
+	}
+	else if (i > 0)
+	{
+		// Let whatever did get queued finish before the buffers go away
+		while (__atomic_load_n(&asyncCompleted, __ATOMIC_ACQUIRE) != i - 1)
+			sched_yield();
+	}
+	free(requests);
+	free(submitted);
+	return ok;
+}
+
+static void runBenchmark(benchApi api, uint32_t baudRate, uint8_t wordSize, bool csAuto)
+{
+	// The divisor is truncated, so the wire runs at or above the requested rate
+	uint32_t divisor = (CLOCK_FREQUENCY / 2) / baudRate;
+	double wireRate = (double)(CLOCK_FREQUENCY / 2) / divisor;
+	bool ok = true;
+
+	spiSetBaudRate(baudRate);
+	spiConfigure(cs, 0, wordSize, csAuto);
+	drainRx();
+
+	uint64_t start = nowNs();
+	switch (api)
+	{
+		case API_WORD:
+			ok = runWord(csAuto);
+			break;
+		case API_TRANSFER:
+			ok = runTransfer(csAuto);
+			break;
+		case API_SEGMENTS:
+			ok = runSegments(wordSize, csAuto);
+			break;
+		default:
+			ok = runAsync(wordSize, csAuto);
+			break;
+	}
+	uint64_t elapsed = nowNs() - start;
+	if (!ok)
+	{
+		fprintf(stderr, "%s: %u-bit run at %u baud failed, words went unanswered or requests could not be queued\n", apiNames[api], wordSize, baudRate);
+		return;
+	}
+
+	qsort(latencies, operations, sizeof(uint64_t), compareLatency);
+	double words = (double)operations * batch;
+	double wordsPerSecond = words * 1e9 / elapsed;
+	double bitsPerSecond = wordsPerSecond * wordSize;
+	printf("%s,%u,%.0f,%u,%s,%u,%u,%.0f,%.0f,%.4f,%llu,%llu,%llu,%llu,%s\n", apiNames[api], baudRate, wireRate, wordSize,
+		csAuto ? "auto" : "manual", operations, batch, wordsPerSecond, bitsPerSecond, bitsPerSecond / wireRate,
+		(unsigned long long)percentile(500), (unsigned long long)percentile(990), (unsigned long long)percentile(999),
+		(unsigned long long)latencies[operations - 1], simulated ? "cycles" : "wall");
+	fflush(stdout);
+}
+
+// Comma separated list of numbers within [min, max]
+static bool parseList(char* text, uint32_t* values, uint32_t* count, uint32_t min, uint32_t max)
+{
+	char* token;
+	*count = 0;
+	for (token = strtok(text, ","); token != NULL; token = strtok(NULL, ","))
+	{
+		char* end;
+		unsigned long value = strtoul(token, &end, 0);
+		if (*end != '\0' || value < min || value > max || *count == MAX_SWEEP)
+			return false;
+		values[(*count)++] = value;
+	}
+	return *count > 0;
+}
+
+static bool parseApis(char* text)
+{
+	char* token;
+	benchApi api;
+	memset(apiEnabled, 0, sizeof(apiEnabled));
+	for (token = strtok(text, ","); token != NULL; token = strtok(NULL, ","))
+	{
+		for (api = 0; api < API_COUNT && strcmp(token, apiNames[api]) != 0; api++);
+		if (api == API_COUNT)
+			return false;
+		apiEnabled[api] = true;
+	}
+	return true;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [-u] [-c cs] [-n operations] [-b words per operation]\n", name);
+	printf("          [-f baud,...] [-w word size,...] [-a word,transfer,segments,async]\n");
+	printf("  -u  open the core through UIO instead of /dev/mem\n");
+	printf("Prints one CSV line per run, latencies are per operation in ns\n");
+}
+
+int main(int argc, char* argv[])
+{
+	bool uio = false;
+	int option;
+	uint32_t f, w, csMode;
+	benchApi api;
+
+	while ((option = getopt(argc, argv, "uc:n:b:f:w:a:h")) != -1)
+	{
+		bool ok = true;
+		switch (option)
+		{
+			case 'u':
+				uio = true;
+				break;
+			case 'c':
+				cs = atoi(optarg);
+				ok = cs <= 3;
+				break;
+			case 'n':
+				operations = atoi(optarg);
+				ok = operations > 0;
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				ok = batch > 0;
+				break;
+			case 'f':
+				ok = parseList(optarg, baudRates, &baudRateCount, 1, CLOCK_FREQUENCY / 2);
+				break;
+			case 'w':
+				ok = parseList(optarg, wordSizes, &wordSizeCount, 1, 32);
+				break;
+			case 'a':
+				ok = parseApis(optarg);
+				break;
+			default:
+				ok = false;
+				break;
+		}
+		if (!ok)
+		{
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!(uio ? openSpiUio(NULL) : openSpi()))
+	{
+		fprintf(stderr, "Error opening the SPI IP module\n");
+		return EXIT_FAILURE;
+	}
+	tx = calloc(batch, sizeof(uint32_t));
+	rx = calloc(batch, sizeof(uint32_t));
+	latencies = calloc(operations, sizeof(uint64_t));
+	if (tx == NULL || rx == NULL || latencies == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if (apiEnabled[API_ASYNC] && !spiAsyncStart())
+	{
+		fprintf(stderr, "Error starting the I/O thread\n");
+		return EXIT_FAILURE;
+	}
+	for (w = 0; w < batch; w++)
+		tx[w] = 0xA5A5A5A5 ^ w;
+
+	enableSpi();
+	simulated = spiBackendSimulated();
+	printf("api,baud,wire_baud,word_size,cs,operations,batch,words_per_s,bits_per_s,wire_efficiency,p50_ns,p99_ns,p999_ns,max_ns,clock\n");
+	for (api = 0; api < API_COUNT; api++)
+	{
+		if (!apiEnabled[api])
+			continue;
+		for (f = 0; f < baudRateCount; f++)
+			for (w = 0; w < wordSizeCount; w++)
+				for (csMode = 0; csMode < 2; csMode++)
+					runBenchmark(api, baudRates[f], wordSizes[w], csMode == 0);
+	}
+
+	spiAsyncStop();
+	free(tx);
+	free(rx);
+	free(latencies);
+	return EXIT_SUCCESS;
+}
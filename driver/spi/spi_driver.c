@@ -14,6 +14,18 @@
 // HPS interface:
 //   Mapped to offset of 0x8000 in light-weight MM interface aperature
 
+// Each SPI IP instance is described by a device tree node:
+//   spi0: spi@ff208000 {
+//       compatible = "jlosh,spi0-1.0";
+//       reg = <0xff208000 0x10>;
+//       interrupts = <0 40 4>;          // optional, level high
+//       clock-frequency = <50000000>;   // optional, defaults to 50 MHz
+//       fifo-depth = <16>;              // optional, defaults to 16
+//   };
+// Instance n shows up as /sys/kernel/spi<n> and /dev/spi<n>, where n is taken
+// from the spi<n> alias when there is one. Per chip select latency histograms
+// and throughput counters are in /sys/kernel/debug/spi<n>/cs<k>.
+
 // Load kernel module with insmod spi_driver.ko [param=___]
 
 //-----------------------------------------------------------------------------
@@ -23,9 +35,28 @@
 #include <linux/init.h>       // __init
 #include <linux/kobject.h>    // kobject, kobject_atribute,
                               // kobject_create_and_add, kobject_put
-#include <asm/io.h>           // iowrite, ioread, ioremap_nocache (platform specific)
+#include <linux/fs.h>         // file_operations
+#include <linux/miscdevice.h> // misc_register, misc_deregister
+#include <linux/uaccess.h>    // copy_from_user
+#include <linux/kfifo.h>      // DECLARE_KFIFO, kfifo_put, kfifo_to_user
+#include <linux/mutex.h>      // mutex_init, mutex_lock
+#include <linux/spinlock.h>   // spin_lock_irqsave
+#include <linux/slab.h>       // devm_kzalloc
+#include <linux/poll.h>       // poll_wait, EPOLLIN, EPOLLOUT
+#include <linux/wait.h>       // wait_queue_head_t, wake_up_interruptible
+#include <linux/interrupt.h>  // devm_request_irq
+#include <linux/hrtimer.h>    // hrtimer used when no irq is wired
+#include <linux/workqueue.h>  // sysfs_notify has to run in process context
+#include <linux/delay.h>      // usleep_range
+#include <linux/platform_device.h> // platform_driver, platform_get_resource
+#include <linux/of.h>         // of_property_read_u32, of_alias_get_id
+#include <linux/ktime.h>      // ktime_get_ns
+#include <linux/debugfs.h>    // debugfs_create_dir, debugfs_create_file
+#include <asm/io.h>           // iowrite, ioread (platform specific)
 #include "spi_regs.h"         // register offsets in SPI IP
-#include "../address_map.h"   // overall memory map
+#include "spi_stats.h"        // latency histograms shown in debugfs
+#define CREATE_TRACE_POINTS
+#include "spi_trace.h"        // spi_ip tracepoints
 
 #define CS0_OFFSET				0x200
 #define CS_SELECT_OFFSET		0x00D
@@ -33,6 +64,17 @@
 #define SPI_MODE_MASK			0x03
 #define SPI_MODE_OFFSET			0x10
 #define WORD_SIZE_MASK			0x1F
+// Cycles spent in the IDLE and CS_ASSERT states between two words
+#define WORD_GAP_CYCLES			3
+
+// Number of words copied from userspace per copy_from_user call
+#define TRANSFER_CHUNK_WORDS	256
+// Number of received words buffered for readers of /dev/spi<n>
+#define RX_BUFFER_WORDS			1024
+
+#define MAX_SPI_DEVICES			8
+#define CS_COUNT				4
+#define DEFAULT_CLOCK_FREQUENCY	50000000
 
 //-----------------------------------------------------------------------------
 // Kernel module information
@@ -46,136 +88,406 @@ MODULE_DESCRIPTION("SPI IP Driver");
 // Global variables
 //-----------------------------------------------------------------------------
 
-static unsigned int* base = NULL;
+// State of one SPI IP instance
+struct spiDevice
+{
+	unsigned int* base;
+	int irq;
+	unsigned int id;
+	uint32_t clockFrequency;
+	// Words per burst, the FIFO pointers in STATUS always count FIFO_DEPTH
+	uint32_t fifoDepth;
+	char name[16];
+
+	// Values last written through sysfs
+	bool spi_enable;
+	unsigned int baud_rate;
+	unsigned int word_size;
+	unsigned int cs_select;
+	unsigned int mode[CS_COUNT];
+	bool cs_auto[CS_COUNT];
+	bool cs_man[CS_COUNT];
+	unsigned int tx_data;
+	unsigned int rx_data;
+
+	// Number of waits completed by each strategy
+	unsigned long poll_completions;
+	unsigned long sleep_completions;
+	struct spiStats stats[CS_COUNT];
+	struct dentry* debugfsDir;
+
+	// Words received while a transfer is in flight are kept here until read
+	DECLARE_KFIFO(rxBuffer, uint32_t, RX_BUFFER_WORDS);
+	uint32_t* txBuffer;
+	struct mutex transferLock;
+	// Held for every read-modify-write of CONTROL
+	spinlock_t controlLock;
+
+	// Woken up when a queued transfer has been shifted out
+	wait_queue_head_t waitQueue;
+	// Set while the ISR has left the irq line masked for notifyWork
+	atomic_t irqMasked;
+	// Transfer whose completion events are still due, no words when there is none
+	spinlock_t pendingLock;
+	size_t pendingWords;
+	unsigned int pendingCs;
+	unsigned int pendingSpins;
+	u64 pendingStart;
+	struct hrtimer completionTimer;
+	struct work_struct notifyWork;
+
+	struct kobject* kobj;
+	struct miscdevice miscDevice;
+};
+
+static struct spiDevice* spiDevices[MAX_SPI_DEVICES];
+static DEFINE_MUTEX(devicesLock);
+
+// Status polling period used when there is no irq
+static unsigned int poll_interval_us = 50;
+module_param(poll_interval_us, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_interval_us, " Status polling period in us when no IRQ is used");
+
+// Transfers estimated to finish within this time are busy-polled, longer ones sleep
+static unsigned int poll_threshold_us = 50;
+module_param(poll_threshold_us, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_threshold_us, " Longest transfer in us that is busy-polled instead of sleeping");
 
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
-void spiWriteData(uint32_t data)
+void spiWriteData(struct spiDevice* spi, uint32_t data)
 {
-	iowrite32(data, base + OFS_DATA);
+	iowrite32(data, spi->base + OFS_DATA);
 }
 
-int spiReadData(void)
+int spiReadData(struct spiDevice* spi)
 {
-	int data = ioread32(base + OFS_DATA);
+	int data = ioread32(spi->base + OFS_DATA);
 	return data;
 }
 
-bool rxFifoIsEmpty(void)
+bool rxFifoIsEmpty(struct spiDevice* spi)
+{
+	return ioread32(spi->base + OFS_STATUS) & STATUS_RXFE;
+}
+
+bool isCsManualEnabled(struct spiDevice* spi, uint8_t n)
 {
-	return ioread32(base + OFS_STATUS) & 4;
+	 return ioread32(spi->base + OFS_CONTROL) & (CS0_OFFSET << n);
 }
 
-bool isCsManualEnabled(uint8_t n)
+// Every read-modify-write of CONTROL goes through here. The sysfs stores, the
+// write path and the completion work all update it, so they are serialized.
+void spiModifyControl(struct spiDevice* spi, uint32_t clear, uint32_t set)
 {
-	 return ioread32(base + OFS_CONTROL) & (CS0_OFFSET << n);
+	unsigned long flags;
+	uint32_t control;
+	spin_lock_irqsave(&spi->controlLock, flags);
+	control = ioread32(spi->base + OFS_CONTROL);
+	iowrite32((control & ~clear) | set, spi->base + OFS_CONTROL);
+	spin_unlock_irqrestore(&spi->controlLock, flags);
 }
 
-void spiEnableCS(uint8_t n)
+void spiEnableCS(struct spiDevice* spi, uint8_t n)
 {
-	int cs = ioread32(base + OFS_CONTROL);
-	iowrite32(cs | (CS0_OFFSET << n), base + OFS_CONTROL);
+	spiModifyControl(spi, 0, CS0_OFFSET << n);
 }
 
-void spiDisableCS(uint8_t n)
+void spiDisableCS(struct spiDevice* spi, uint8_t n)
 {
-	int cs = ioread32(base + OFS_CONTROL);
-	iowrite32(cs & ~(CS0_OFFSET << n), base + OFS_CONTROL);
+	spiModifyControl(spi, CS0_OFFSET << n, 0);
 }
 
-void spiCsSelect(uint32_t n)
+void spiCsSelect(struct spiDevice* spi, uint32_t n)
 {
-	int cs = ioread32(base + OFS_CONTROL) & ~(0x00006000);
-	iowrite32(cs | (n << CS_SELECT_OFFSET), base + OFS_CONTROL);
+	spiModifyControl(spi, 0x00006000, n << CS_SELECT_OFFSET);
 }
 
-bool isCsAutoEnabled(uint8_t n)
+bool isCsAutoEnabled(struct spiDevice* spi, uint8_t n)
 {
-	return ioread32(base + OFS_CONTROL) & (0x00000020 << n);
+	return ioread32(spi->base + OFS_CONTROL) & (0x00000020 << n);
 }
 
-void spiCsAutoEnable(uint8_t n)
+void spiCsAutoEnable(struct spiDevice* spi, uint8_t n)
 {
-	int cs = ioread32(base + OFS_CONTROL) & ~(0x00000020 << n);
-	iowrite32(cs | (0x00000020 << n), base + OFS_CONTROL);
+	spiModifyControl(spi, 0, 0x00000020 << n);
 }
 
-void spiCsAutoDisable(uint8_t n)
+void spiCsAutoDisable(struct spiDevice* spi, uint8_t n)
 {
-	int cs = ioread32(base + OFS_CONTROL) & ~(0x00000020 << n);
-	iowrite32(cs, base + OFS_CONTROL);
+	spiModifyControl(spi, 0x00000020 << n, 0);
 }
 
-void spiClearCsSelect(void)
+void spiClearCsSelect(struct spiDevice* spi)
 {
-	int cs = ioread32(base + OFS_CONTROL) & ~(0x00006000);
-	iowrite32(cs, base + OFS_CONTROL);
+	spiModifyControl(spi, 0x00006000, 0);
 }
 
-void spiEnable(void)
+void spiEnable(struct spiDevice* spi)
 {
-	int cs = ioread32(base + OFS_CONTROL) | CS_ENABLE;
-	iowrite32(cs, base + OFS_CONTROL);
+	spiModifyControl(spi, 0, CS_ENABLE);
 }
 
-void spiDisable(void)
+void spiDisable(struct spiDevice* spi)
 {
-	int cs = ioread32(base + OFS_CONTROL) & ~CS_ENABLE;
-	iowrite32(cs, base + OFS_CONTROL);
+	spiModifyControl(spi, CS_ENABLE, 0);
 }
 
-void spiSetMode(uint8_t n, uint32_t spoSph)
+void spiSetMode(struct spiDevice* spi, uint8_t n, uint32_t spoSph)
 {
-	int mode = ioread32(base + OFS_CONTROL) & ~(SPI_MODE_MASK << (SPI_MODE_OFFSET + (n << 1)));
-	iowrite32(mode | (spoSph << (SPI_MODE_OFFSET + (n << 1))), base + OFS_CONTROL);
+	spiModifyControl(spi, SPI_MODE_MASK << (SPI_MODE_OFFSET + (n << 1)), spoSph << (SPI_MODE_OFFSET + (n << 1)));
 }
 
-// The cycle is fixed to 50 MHz
-void spiSetBaudRate(uint32_t baudRate)
+// The cycle is given by the clock-frequency of the instance
+void spiSetBaudRate(struct spiDevice* spi, uint32_t baudRate)
 {
 	// Baud Rate = fcycle / divisor
-	unsigned int divisor = (50000000 / 2) / baudRate;
-	iowrite32(divisor << 7, base + OFS_BRD);
+	unsigned int divisor = (spi->clockFrequency / 2) / baudRate;
+	iowrite32(divisor << 7, spi->base + OFS_BRD);
+}
+
+void setWordSize(struct spiDevice* spi, uint8_t wordSize)
+{
+	spiModifyControl(spi, WORD_SIZE_MASK, wordSize);
+}
+
+bool isSpiEnabled(struct spiDevice* spi)
+{
+	return ioread32(spi->base + OFS_CONTROL) & CS_ENABLE;
+}
+
+// The read and write pointers of the RX FIFO are reported in the status register
+unsigned int rxFifoLevel(struct spiDevice* spi, uint32_t status)
+{
+	if (status & STATUS_RXFF)
+		return FIFO_DEPTH;
+	return ((status >> STATUS_WP_OFFSET) - (status >> STATUS_RP_OFFSET)) & (FIFO_DEPTH - 1);
+}
+
+// Returns the number of status reads spent spinning
+unsigned int spiWaitTxEmpty(struct spiDevice* spi)
+{
+	unsigned int pollSpins = 0;
+	while (!(ioread32(spi->base + OFS_STATUS) & STATUS_TXFE))
+	{
+		pollSpins++;
+		cpu_relax();
+	}
+	return pollSpins;
+}
+
+// Moves everything in the RX FIFO into the rx buffer using one status read
+void spiDrainRx(struct spiDevice* spi)
+{
+	uint32_t words[FIFO_DEPTH];
+	unsigned int level = rxFifoLevel(spi, ioread32(spi->base + OFS_STATUS));
+	if (level == 0)
+		return;
+	ioread32_rep(spi->base + OFS_DATA, words, level);
+	// The oldest words are dropped if nobody is reading them
+	while (kfifo_avail(&spi->rxBuffer) < level)
+		kfifo_skip(&spi->rxBuffer);
+	kfifo_in(&spi->rxBuffer, words, level);
+}
+
+void spiIrqEnable(struct spiDevice* spi, uint32_t mask)
+{
+	spiModifyControl(spi, 0, mask);
+}
+
+void spiIrqDisable(struct spiDevice* spi, uint32_t mask)
+{
+	spiModifyControl(spi, mask, 0);
+}
+
+// Chip select the next words go out on
+unsigned int spiControlCs(struct spiDevice* spi)
+{
+	return (ioread32(spi->base + OFS_CONTROL) >> CS_SELECT_OFFSET) & (CS_COUNT - 1);
+}
+
+// Called once the TX FIFO has been shifted out. Since the IP only shifts
+// words in while shifting words out, this also means all RX data is ready.
+// Runs from the ISR, the completion timer and the write path, whichever
+// gets there first ends the pending transfer.
+static void spiTransferDone(struct spiDevice* spi)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&spi->pendingLock, flags);
+	if (spi->pendingWords)
+	{
+		u64 latencyNs = ktime_get_ns() - spi->pendingStart;
+		trace_spi_last_word(spi->id, spi->pendingCs, spi->pendingWords);
+		spiStatsRecord(&spi->stats[spi->pendingCs], spi->pendingWords, spi->pendingSpins, latencyNs);
+		trace_spi_complete(spi->id, spi->pendingCs, spi->pendingWords, spi->pendingSpins, latencyNs);
+		spi->pendingWords = 0;
+	}
+	spin_unlock_irqrestore(&spi->pendingLock, flags);
+	wake_up_interruptible(&spi->waitQueue);
+	schedule_work(&spi->notifyWork);
 }
 
-void setWordSize(uint8_t wordSize)
+static void notifyWorkHandler(struct work_struct* work)
 {
-	int readWordSize = ioread32(base + OFS_CONTROL) & ~WORD_SIZE_MASK;
-	iowrite32(readWordSize | wordSize, base + OFS_CONTROL);
+	struct spiDevice* spi = container_of(work, struct spiDevice, notifyWork);
+	// Completions from the write path did not come through the ISR
+	if (spi->irq > 0 && atomic_xchg(&spi->irqMasked, 0))
+	{
+		spiIrqDisable(spi, TXFE_IRQ_ENABLE);
+		enable_irq(spi->irq);
+	}
+	sysfs_notify(spi->kobj, NULL, "rx_data");
+}
+
+static irqreturn_t spiIsr(int irq, void* data)
+{
+	struct spiDevice* spi = data;
+	// The line is level sensitive, keep it masked until the work item
+	// has cleared the interrupt enable
+	disable_irq_nosync(irq);
+	atomic_set(&spi->irqMasked, 1);
+	spiTransferDone(spi);
+	return IRQ_HANDLED;
+}
+
+static enum hrtimer_restart completionTimerHandler(struct hrtimer* timer)
+{
+	struct spiDevice* spi = container_of(timer, struct spiDevice, completionTimer);
+	if (!(ioread32(spi->base + OFS_STATUS) & STATUS_TXFE))
+	{
+		hrtimer_forward_now(timer, ns_to_ktime(poll_interval_us * NSEC_PER_USEC));
+		return HRTIMER_RESTART;
+	}
+	spiTransferDone(spi);
+	return HRTIMER_NORESTART;
+}
+
+// Ends a transfer whose completion has not come in yet once the TX FIFO is empty
+void spiTransferFlush(struct spiDevice* spi)
+{
+	if (READ_ONCE(spi->pendingWords))
+	{
+		spiWaitTxEmpty(spi);
+		spiTransferDone(spi);
+	}
+}
+
+// Records a transfer for spiTransferDone, called with transferLock held
+void spiTransferQueued(struct spiDevice* spi, unsigned int cs, size_t words, unsigned int pollSpins, u64 start)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&spi->pendingLock, flags);
+	spi->pendingWords = words;
+	spi->pendingCs = cs;
+	spi->pendingSpins = pollSpins;
+	spi->pendingStart = start;
+	spin_unlock_irqrestore(&spi->pendingLock, flags);
+}
+
+// Requests a wakeup once whatever is in the TX FIFO has been shifted out
+void spiArmCompletion(struct spiDevice* spi)
+{
+	if (spi->irq > 0)
+		spiIrqEnable(spi, TXFE_IRQ_ENABLE);
+	else
+		hrtimer_start(&spi->completionTimer, ns_to_ktime(poll_interval_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+}
+
+// Time to shift one word out at the word size in control and the current baud rate
+uint32_t spiWordTimeNs(struct spiDevice* spi, uint32_t control)
+{
+	uint32_t bits = (control & WORD_SIZE_MASK) + 1;
+	// BRD holds the half period in clock cycles with 7 fractional bits
+	uint64_t halfPeriodCycles = ioread32(spi->base + OFS_BRD);
+	uint64_t cycles = ((bits * 2 * halfPeriodCycles) >> 7) + WORD_GAP_CYCLES;
+	return (uint32_t)div_u64(cycles * NSEC_PER_SEC, spi->clockFrequency);
+}
+
+// Waits for the TX FIFO to empty given how long it should take.
+// Short transfers finish before a sleep or interrupt round trip would,
+// so they are busy-polled. Longer ones sleep for most of the estimate.
+unsigned int spiWaitTransfer(struct spiDevice* spi, uint32_t ns)
+{
+	if (ns > poll_threshold_us * NSEC_PER_USEC)
+	{
+		spi->sleep_completions++;
+		if (spi->irq > 0)
+		{
+			spiArmCompletion(spi);
+			wait_event_timeout(spi->waitQueue, ioread32(spi->base + OFS_STATUS) & STATUS_TXFE, nsecs_to_jiffies(ns) + 1);
+		}
+		else
+			usleep_range(ns / NSEC_PER_USEC, ns / NSEC_PER_USEC + poll_interval_us);
+	}
+	// Nothing in flight is not a completion
+	else if (ns > 0)
+		spi->poll_completions++;
+	return spiWaitTxEmpty(spi);
+}
+
+// Sends a buffer of words, bursting a full FIFO at a time.
+// Each burst is only written once the previous one has been shifted out
+// and its received words have been drained, so the RX FIFO never overflows.
+// Returns the number of status reads spent spinning.
+unsigned int spiWriteBurst(struct spiDevice* spi, const uint32_t* words, size_t n, uint32_t wordNs, unsigned int cs, bool first)
+{
+	size_t i;
+	size_t inFlight = 0;
+	unsigned int pollSpins = 0;
+	for (i = 0; i < n; i += spi->fifoDepth)
+	{
+		size_t burst = min_t(size_t, n - i, spi->fifoDepth);
+		pollSpins += spiWaitTransfer(spi, inFlight * wordNs);
+		spiDrainRx(spi);
+		iowrite32_rep(spi->base + OFS_DATA, words + i, burst);
+		if (first && i == 0)
+			trace_spi_first_word(spi->id, cs, burst);
+		inFlight = burst;
+	}
+	pollSpins += spiWaitTransfer(spi, inFlight * wordNs);
+	spiDrainRx(spi);
+	return pollSpins;
 }
 
 //-----------------------------------------------------------------------------
 // Kernel Objects
 //-----------------------------------------------------------------------------
 
-// SPI Enable
-static bool spi_enable = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(spi_enable, bool, S_IRUGO);
-MODULE_PARM_DESC(spi_enable, " Enables the SPI engine");
+// Every instance has its own kobject, the attributes look their instance up from it
+static struct spiDevice* spiFromKobj(struct kobject* kobj)
+{
+	unsigned int i;
+	for (i = 0; i < MAX_SPI_DEVICES; i++)
+		if (spiDevices[i] != NULL && spiDevices[i]->kobj == kobj)
+			return spiDevices[i];
+	return NULL;
+}
 
+// SPI Enable
 static ssize_t spiEnableStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
+	struct spiDevice* spi = spiFromKobj(kobj);
 	if (strncmp(buffer, "true", count - 1) == 0)
 	{
-		spiEnable();
-		spi_enable = true;
+		spiEnable(spi);
+		spi->spi_enable = true;
 	}
 	else
 		if (strncmp(buffer, "false", count - 1) == 0)
 		{
-			spiDisable();
-			spi_enable = false;
+			spiDisable(spi);
+			spi->spi_enable = false;
 		}
 	return count;
 }
 
 static ssize_t spiEnableShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	spi_enable = isCsAutoEnabled(1);
-	if (spi_enable)
+	struct spiDevice* spi = spiFromKobj(kobj);
+	spi->spi_enable = isSpiEnabled(spi);
+	if (spi->spi_enable)
 		strcpy(buffer, "true\n");
 	else
 		strcpy(buffer, "false\n");
@@ -185,467 +497,347 @@ static ssize_t spiEnableShow(struct kobject* kobj, struct kobj_attribute* attr,
 static struct kobj_attribute spiEnableAttr = __ATTR(spi_enable, 0664, spiEnableShow, spiEnableStore);
 
 // Baud Rate
-static unsigned int baud_rate = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(baud_rate, uint, S_IRUGO);
-MODULE_PARM_DESC(baud_rate, " Set the Baud Rate");
-
 static ssize_t baudRateStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &baud_rate);
+	struct spiDevice* spi = spiFromKobj(kobj);
+	unsigned int result = kstrtouint(buffer, 0, &spi->baud_rate);
 	if (result == 0)
-		spiSetBaudRate(baud_rate);
+		spiSetBaudRate(spi, spi->baud_rate);
 	return count;
 }
 
 static ssize_t baudRateShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	return sprintf(buffer, "%u\n", baud_rate);
+	return sprintf(buffer, "%u\n", spiFromKobj(kobj)->baud_rate);
 }
 
 static struct kobj_attribute baudRateAttr = __ATTR(baud_rate, 0664, baudRateShow, baudRateStore);
 
 // Word Size
-static unsigned int word_size = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(word_size, uint, S_IRUGO);
-MODULE_PARM_DESC(word_size, " Set the Word Size");
-
 static ssize_t wordSizeStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &word_size);
+	struct spiDevice* spi = spiFromKobj(kobj);
+	unsigned int result = kstrtouint(buffer, 0, &spi->word_size);
 	if (result == 0)
-		setWordSize(word_size - 1);
+		setWordSize(spi, spi->word_size - 1);
 	return count;
 }
 
 static ssize_t wordSizeShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	return sprintf(buffer, "%u\n", word_size);
+	return sprintf(buffer, "%u\n", spiFromKobj(kobj)->word_size);
 }
 
 static struct kobj_attribute wordSizeAttr = __ATTR(word_size, 0664, wordSizeShow, wordSizeStore);
 
 // CS Select
-static unsigned int cs_select = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_select, uint, S_IRUGO);
-MODULE_PARM_DESC(cs_select, " Set the Chipselect");
-
 static ssize_t csSelectStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &cs_select);
+	struct spiDevice* spi = spiFromKobj(kobj);
+	unsigned int result = kstrtouint(buffer, 0, &spi->cs_select);
 	if (result == 0)
-		spiCsSelect(cs_select);
+		spiCsSelect(spi, spi->cs_select);
 	return count;
 }
 
 static ssize_t csSelectShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	return sprintf(buffer, "%u\n", cs_select);
+	return sprintf(buffer, "%u\n", spiFromKobj(kobj)->cs_select);
 }
 
 static struct kobj_attribute csSelectAttr = __ATTR(cs_select, 0664, csSelectShow, csSelectStore);
 
-// Device 0
-// Mode 0
-static unsigned int mode0 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(mode0, uint, S_IRUGO);
-MODULE_PARM_DESC(mode0, " Sets the SPI Mode");
-
-static ssize_t mode0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+// Mode, CS Auto and CS Manual of device n
+static ssize_t modeStore(struct kobject* kobj, uint8_t n, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &mode0);
+	struct spiDevice* spi = spiFromKobj(kobj);
+	unsigned int result = kstrtouint(buffer, 0, &spi->mode[n]);
 	if (result == 0)
-		spiSetMode(0, mode0);
+		spiSetMode(spi, n, spi->mode[n]);
 	return count;
 }
 
-static ssize_t mode0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+static ssize_t modeShow(struct kobject* kobj, uint8_t n, char* buffer)
 {
-	return sprintf(buffer, "%u\n", mode0);
+	return sprintf(buffer, "%u\n", spiFromKobj(kobj)->mode[n]);
 }
 
-static struct kobj_attribute mode0Attr = __ATTR(mode, 0664, mode0Show, mode0Store);
-
-// CS Auto 0
-static bool cs_auto0 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_auto0, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto0, " Sets the SPI CS Auto Mode");
-
-static ssize_t csAuto0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+static ssize_t csAutoStore(struct kobject* kobj, uint8_t n, const char* buffer, size_t count)
 {
+	struct spiDevice* spi = spiFromKobj(kobj);
 	if (strncmp(buffer, "true", count - 1) == 0)
 	{
-		spiCsAutoEnable(0);
-		cs_auto0 = true;
+		spiCsAutoEnable(spi, n);
+		spi->cs_auto[n] = true;
 	}
 	else
 		if (strncmp(buffer, "false", count - 1) == 0)
 		{
-			spiCsAutoDisable(0);
-			cs_auto0 = false;
+			spiCsAutoDisable(spi, n);
+			spi->cs_auto[n] = false;
 		}
 	return count;
 }
 
-static ssize_t csAuto0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+static ssize_t csAutoShow(struct kobject* kobj, uint8_t n, char* buffer)
 {
-	cs_auto0 = isCsAutoEnabled(1);
-	if (cs_auto0)
+	struct spiDevice* spi = spiFromKobj(kobj);
+	spi->cs_auto[n] = isCsAutoEnabled(spi, n);
+	if (spi->cs_auto[n])
 		strcpy(buffer, "true\n");
 	else
 		strcpy(buffer, "false\n");
 	return strlen(buffer);
 }
 
-static struct kobj_attribute csAuto0Attr = __ATTR(cs_auto, 0664, csAuto0Show, csAuto0Store);
-
-// CS Manual 0
-static bool cs_man0 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_man0, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_man0, " Sets the SPI CS Manual Mode");
-
-static ssize_t csMan0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+static ssize_t csManStore(struct kobject* kobj, uint8_t n, const char* buffer, size_t count)
 {
+	struct spiDevice* spi = spiFromKobj(kobj);
 	if (strncmp(buffer, "true", count - 1) == 0)
 	{
-		spiEnableCS(0);
-		cs_man0 = true;
+		spiEnableCS(spi, n);
+		spi->cs_man[n] = true;
 	}
 	else
 		if (strncmp(buffer, "false", count - 1) == 0)
 		{
-			spiDisableCS(0);
-			cs_man0 = false;
+			spiDisableCS(spi, n);
+			spi->cs_man[n] = false;
 		}
 	return count;
 }
 
-static ssize_t csMan0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+static ssize_t csManShow(struct kobject* kobj, uint8_t n, char* buffer)
 {
-	cs_man0 = isCsManualEnabled(0);
-	if (cs_man0)
+	struct spiDevice* spi = spiFromKobj(kobj);
+	spi->cs_man[n] = isCsManualEnabled(spi, n);
+	if (spi->cs_man[n])
 		strcpy(buffer, "true\n");
 	else
 		strcpy(buffer, "false\n");
 	return strlen(buffer);
 }
 
+// Device 0
+static ssize_t mode0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	return modeStore(kobj, 0, buffer, count);
+}
+
+static ssize_t mode0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	return modeShow(kobj, 0, buffer);
+}
+
+static struct kobj_attribute mode0Attr = __ATTR(mode, 0664, mode0Show, mode0Store);
+
+static ssize_t csAuto0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	return csAutoStore(kobj, 0, buffer, count);
+}
+
+static ssize_t csAuto0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	return csAutoShow(kobj, 0, buffer);
+}
+
+static struct kobj_attribute csAuto0Attr = __ATTR(cs_auto, 0664, csAuto0Show, csAuto0Store);
+
+static ssize_t csMan0Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
+{
+	return csManStore(kobj, 0, buffer, count);
+}
+
+static ssize_t csMan0Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	return csManShow(kobj, 0, buffer);
+}
+
 static struct kobj_attribute csMan0Attr = __ATTR(cs_man, 0664, csMan0Show, csMan0Store);
 
 // Device 1
-// Mode 1
-static unsigned int mode1 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(mode1, uint, S_IRUGO);
-MODULE_PARM_DESC(mode1, " Sets the SPI Mode");
-
 static ssize_t mode1Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &mode1);
-	if (result == 0)
-		spiSetMode(1, mode1);
-	return count;
+	return modeStore(kobj, 1, buffer, count);
 }
 
 static ssize_t mode1Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	return sprintf(buffer, "%u\n", mode1);
+	return modeShow(kobj, 1, buffer);
 }
 
 static struct kobj_attribute mode1Attr = __ATTR(mode, 0664, mode1Show, mode1Store);
 
-// CS Auto 1
-static bool cs_auto1 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_auto1, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto1, " Sets the SPI CS Auto Mode");
-
 static ssize_t csAuto1Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	if (strncmp(buffer, "true", count - 1) == 0)
-	{
-		spiCsAutoEnable(1);
-		cs_auto1 = true;
-	}
-	else
-		if (strncmp(buffer, "false", count - 1) == 0)
-		{
-			spiCsAutoDisable(1);
-			cs_auto1 = false;
-		}
-	return count;
+	return csAutoStore(kobj, 1, buffer, count);
 }
 
 static ssize_t csAuto1Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	cs_auto1 = isCsAutoEnabled(1);
-	if (cs_auto1)
-		strcpy(buffer, "true\n");
-	else
-		strcpy(buffer, "false\n");
-	return strlen(buffer);
+	return csAutoShow(kobj, 1, buffer);
 }
 
 static struct kobj_attribute csAuto1Attr = __ATTR(cs_auto, 0664, csAuto1Show, csAuto1Store);
 
-// CS Manual 1
-static bool cs_man1 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_man1, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_man1, " Sets the SPI CS Manual Mode");
-
 static ssize_t csMan1Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	if (strncmp(buffer, "true", count - 1) == 0)
-	{
-		spiEnableCS(1);
-		cs_man1 = true;
-	}
-	else
-		if (strncmp(buffer, "false", count - 1) == 0)
-		{
-			spiDisableCS(1);
-			cs_man1 = false;
-		}
-	return count;
+	return csManStore(kobj, 1, buffer, count);
 }
 
 static ssize_t csMan1Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	cs_man1 = isCsManualEnabled(1);
-	if (cs_man1)
-		strcpy(buffer, "true\n");
-	else
-		strcpy(buffer, "false\n");
-	return strlen(buffer);
+	return csManShow(kobj, 1, buffer);
 }
 
 static struct kobj_attribute csMan1Attr = __ATTR(cs_man, 0664, csMan1Show, csMan1Store);
 
 // Device 2
-// Mode 2
-static unsigned int mode2 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(mode2, uint, S_IRUGO);
-MODULE_PARM_DESC(mode2, " Sets the SPI Mode");
-
 static ssize_t mode2Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &mode2);
-	if (result == 0)
-		spiSetMode(2, mode2);
-	return count;
+	return modeStore(kobj, 2, buffer, count);
 }
 
 static ssize_t mode2Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	return sprintf(buffer, "%u\n", mode2);
+	return modeShow(kobj, 2, buffer);
 }
 
 static struct kobj_attribute mode2Attr = __ATTR(mode, 0664, mode2Show, mode2Store);
 
-// CS Auto 2
-static bool cs_auto2 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_auto2, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto2, " Sets the SPI CS Auto Mode");
-
 static ssize_t csAuto2Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	if (strncmp(buffer, "true", count - 1) == 0)
-	{
-		spiCsAutoEnable(2);
-		cs_auto2 = true;
-	}
-	else
-		if (strncmp(buffer, "false", count - 1) == 0)
-		{
-			spiCsAutoDisable(2);
-			cs_auto2 = false;
-		}
-	return count;
+	return csAutoStore(kobj, 2, buffer, count);
 }
 
 static ssize_t csAuto2Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	cs_auto2 = isCsAutoEnabled(2);
-	if (cs_auto2)
-		strcpy(buffer, "true\n");
-	else
-		strcpy(buffer, "false\n");
-	return strlen(buffer);
+	return csAutoShow(kobj, 2, buffer);
 }
 
 static struct kobj_attribute csAuto2Attr = __ATTR(cs_auto, 0664, csAuto2Show, csAuto2Store);
 
-// CS Manual 2
-static bool cs_man2 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_man2, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_man2, " Sets the SPI CS Manual Mode");
-
 static ssize_t csMan2Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	if (strncmp(buffer, "true", count - 1) == 0)
-	{
-		spiEnableCS(2);
-		cs_man2 = true;
-	}
-	else
-		if (strncmp(buffer, "false", count - 1) == 0)
-		{
-			spiDisableCS(2);
-			cs_man2 = false;
-		}
-	return count;
+	return csManStore(kobj, 2, buffer, count);
 }
 
 static ssize_t csMan2Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	cs_man2 = isCsManualEnabled(2);
-	if (cs_man2)
-		strcpy(buffer, "true\n");
-	else
-		strcpy(buffer, "false\n");
-	return strlen(buffer);
+	return csManShow(kobj, 2, buffer);
 }
 
 static struct kobj_attribute csMan2Attr = __ATTR(cs_man, 0664, csMan2Show, csMan2Store);
 
 // Device 3
-// Mode 3
-static unsigned int mode3 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(mode3, uint, S_IRUGO);
-MODULE_PARM_DESC(mode3, " Sets the SPI Mode");
-
 static ssize_t mode3Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &mode3);
-	if (result == 0)
-		spiSetMode(3, mode3);
-	return count;
+	return modeStore(kobj, 3, buffer, count);
 }
 
 static ssize_t mode3Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	return sprintf(buffer, "%u\n", mode3);
+	return modeShow(kobj, 3, buffer);
 }
 
 static struct kobj_attribute mode3Attr = __ATTR(mode, 0664, mode3Show, mode3Store);
 
-// CS Auto 3
-static bool cs_auto3 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_auto3, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto3, " Sets the SPI CS Auto Mode");
-
 static ssize_t csAuto3Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	if (strncmp(buffer, "true", count - 1) == 0)
-	{
-		spiCsAutoEnable(3);
-		cs_auto3 = true;
-	}
-	else
-		if (strncmp(buffer, "false", count - 1) == 0)
-		{
-			spiCsAutoDisable(3);
-			cs_auto3 = false;
-		}
-	return count;
+	return csAutoStore(kobj, 3, buffer, count);
 }
 
 static ssize_t csAuto3Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	cs_auto3 = isCsAutoEnabled(3);
-	if (cs_auto3)
-		strcpy(buffer, "true\n");
-	else
-		strcpy(buffer, "false\n");
-	return strlen(buffer);
+	return csAutoShow(kobj, 3, buffer);
 }
 
 static struct kobj_attribute csAuto3Attr = __ATTR(cs_auto, 0664, csAuto3Show, csAuto3Store);
 
-// CS Manual 3
-static bool cs_man3 = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(cs_man3, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_man3, " Sets the SPI CS Manual Mode");
-
 static ssize_t csMan3Store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	if (strncmp(buffer, "true", count - 1) == 0)
-	{
-		spiEnableCS(3);
-		cs_man3 = true;
-	}
-	else
-		if (strncmp(buffer, "false", count - 1) == 0)
-		{
-			spiDisableCS(3);
-			cs_man3 = false;
-		}
-	return count;
+	return csManStore(kobj, 3, buffer, count);
 }
 
 static ssize_t csMan3Show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	cs_man3 = isCsManualEnabled(3);
-	if (cs_man3)
-		strcpy(buffer, "true\n");
-	else
-		strcpy(buffer, "false\n");
-	return strlen(buffer);
+	return csManShow(kobj, 3, buffer);
 }
 
 static struct kobj_attribute csMan3Attr = __ATTR(cs_man, 0664, csMan3Show, csMan3Store);
 
 // TX Data
-static unsigned int tx_data = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(tx_data, uint, S_IRUGO);
-MODULE_PARM_DESC(tx_data, " Enqueues new data into the TX FIFO");
-
 static ssize_t txDataStore(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count)
 {
-	unsigned int result = kstrtouint(buffer, 0, &tx_data);
+	struct spiDevice* spi = spiFromKobj(kobj);
+	unsigned int result = kstrtouint(buffer, 0, &spi->tx_data);
+	u64 start = ktime_get_ns();
+	unsigned int cs;
 	if (result == 0)
-		spiWriteData(tx_data);
+	{
+		cs = spiControlCs(spi);
+		trace_spi_submit(spi->id, cs, 1);
+		mutex_lock(&spi->transferLock);
+		spiTransferFlush(spi);
+		spiWriteData(spi, spi->tx_data);
+		trace_spi_first_word(spi->id, cs, 1);
+		spiTransferQueued(spi, cs, 1, 0, start);
+		spiArmCompletion(spi);
+		mutex_unlock(&spi->transferLock);
+	}
 	return count;
 }
 
 static struct kobj_attribute txDataAttr = __ATTR(tx_data, 0664, NULL, txDataStore);
 
 // RX Data
-static unsigned int rx_data = 0;
-// Root, Registered User, Guest - S_IRUGO
-module_param(rx_data, uint, S_IRUGO);
-MODULE_PARM_DESC(rx_data, " Dequeues new data into the RX FIFO");
-
 static ssize_t rxDataShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
 {
-	bool empty = rxFifoIsEmpty();
-	if(!empty)
-		rx_data = spiReadData();
-	return sprintf(buffer, empty ? "%d\n" : "%u\n", empty ? -1 : rx_data);
+	struct spiDevice* spi = spiFromKobj(kobj);
+	bool empty;
+	mutex_lock(&spi->transferLock);
+	// Words already drained by a transfer on /dev/spi<n> come first
+	empty = !kfifo_get(&spi->rxBuffer, &spi->rx_data);
+	if (empty)
+	{
+		empty = rxFifoIsEmpty(spi);
+		if (!empty)
+			spi->rx_data = spiReadData(spi);
+	}
+	mutex_unlock(&spi->transferLock);
+	return sprintf(buffer, empty ? "%d\n" : "%u\n", empty ? -1 : spi->rx_data);
 }
 
 static struct kobj_attribute rxDataAttr = __ATTR(rx_data, 0664, rxDataShow, NULL);
 
+// Completion statistics
+static ssize_t pollCompletionsShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	return sprintf(buffer, "%lu\n", spiFromKobj(kobj)->poll_completions);
+}
+
+static struct kobj_attribute pollCompletionsAttr = __ATTR(poll_completions, 0444, pollCompletionsShow, NULL);
+
+static ssize_t sleepCompletionsShow(struct kobject* kobj, struct kobj_attribute* attr, char* buffer)
+{
+	return sprintf(buffer, "%lu\n", spiFromKobj(kobj)->sleep_completions);
+}
+
+static struct kobj_attribute sleepCompletionsAttr = __ATTR(sleep_completions, 0444, sleepCompletionsShow, NULL);
+
 // Attributes
-static struct attribute* attrs[] = { &baudRateAttr.attr, &wordSizeAttr.attr, &csSelectAttr.attr, &txDataAttr.attr, &rxDataAttr.attr, &spiEnableAttr.attr, NULL };
+static struct attribute* attrs[] = { &baudRateAttr.attr, &wordSizeAttr.attr, &csSelectAttr.attr, &txDataAttr.attr, &rxDataAttr.attr, &spiEnableAttr.attr,
+	&pollCompletionsAttr.attr, &sleepCompletionsAttr.attr, NULL };
 static struct attribute* dev0Attrs[] = { &mode0Attr.attr, &csAuto0Attr.attr, &csMan0Attr.attr, NULL };
 static struct attribute* dev1Attrs[] = { &mode1Attr.attr, &csAuto1Attr.attr, &csMan1Attr.attr, NULL };
 static struct attribute* dev2Attrs[] = { &mode2Attr.attr, &csAuto2Attr.attr, &csMan2Attr.attr, NULL };
 static struct attribute* dev3Attrs[] = { &mode3Attr.attr, &csAuto3Attr.attr, &csMan3Attr.attr, NULL };
 
+static struct attribute_group group =
+{
+	.attrs = attrs
+};
+
 static struct attribute_group group0 =
 {
 	.name = "device_0",
@@ -670,55 +862,332 @@ static struct attribute_group group3 =
 	.attrs = dev3Attrs
 };
 
-static struct kobject* kobj;
+static const struct attribute_group* groups[] = { &group, &group0, &group1, &group2, &group3, NULL };
 
 //-----------------------------------------------------------------------------
-// Initialization and Exit
+// Character Device
 //-----------------------------------------------------------------------------
 
-static int __init initialize_module(void)
+static struct spiDevice* spiFromFile(struct file* file)
+{
+	// misc_open stores the miscdevice in private_data
+	return container_of(file->private_data, struct spiDevice, miscDevice);
+}
+
+// Non-blocking writes enqueue at most one FIFO worth of words and return
+// right away, poll() reports EPOLLOUT once they have been shifted out
+static ssize_t spiDevWriteNonBlocking(struct spiDevice* spi, const char __user* buffer, size_t words, unsigned int cs, u64 start)
+{
+	uint32_t data[FIFO_DEPTH];
+
+	if (!(ioread32(spi->base + OFS_STATUS) & STATUS_TXFE))
+		return -EAGAIN;
+	words = min_t(size_t, words, spi->fifoDepth);
+	if (copy_from_user(data, buffer, words * sizeof(uint32_t)))
+		return -EFAULT;
+	spiTransferFlush(spi);
+	spiDrainRx(spi);
+	iowrite32_rep(spi->base + OFS_DATA, data, words);
+	trace_spi_first_word(spi->id, cs, words);
+	spiTransferQueued(spi, cs, words, 0, start);
+	spiArmCompletion(spi);
+	return words * sizeof(uint32_t);
+}
+
+// Writes to /dev/spi<n> are a stream of 32-bit words, each one is enqueued as is
+// into the TX FIFO. The words shifted in are read back from /dev/spi<n>.
+static ssize_t spiDevWrite(struct file* file, const char __user* buffer, size_t count, loff_t* offset)
+{
+	struct spiDevice* spi = spiFromFile(file);
+	size_t words = count / sizeof(uint32_t);
+	size_t done = 0;
+	ssize_t result = 0;
+	u64 start = ktime_get_ns();
+	unsigned int pollSpins = 0;
+	uint32_t control;
+	uint32_t wordNs;
+	unsigned int cs;
+
+	if (words == 0)
+		return -EINVAL;
+	trace_spi_submit(spi->id, spiControlCs(spi), words);
+	if (mutex_lock_interruptible(&spi->transferLock))
+		return -ERESTARTSYS;
+	if (!isSpiEnabled(spi))
+	{
+		mutex_unlock(&spi->transferLock);
+		return -EIO;
+	}
+
+	cs = spiControlCs(spi);
+	if (file->f_flags & O_NONBLOCK)
+	{
+		result = spiDevWriteNonBlocking(spi, buffer, words, cs, start);
+		mutex_unlock(&spi->transferLock);
+		return result;
+	}
+
+	spiTransferFlush(spi);
+	control = ioread32(spi->base + OFS_CONTROL);
+	wordNs = spiWordTimeNs(spi, control);
+	while (done < words)
+	{
+		size_t chunk = min_t(size_t, words - done, TRANSFER_CHUNK_WORDS);
+		if (copy_from_user(spi->txBuffer, buffer + done * sizeof(uint32_t), chunk * sizeof(uint32_t)))
+		{
+			result = -EFAULT;
+			break;
+		}
+		pollSpins += spiWriteBurst(spi, spi->txBuffer, chunk, wordNs, cs, done == 0);
+		done += chunk;
+	}
+
+	// The replies are in rxBuffer now, wake readers and poll() waiters
+	if (done)
+	{
+		spiTransferQueued(spi, cs, done, pollSpins, start);
+		spiTransferDone(spi);
+	}
+
+	mutex_unlock(&spi->transferLock);
+	return done ? done * sizeof(uint32_t) : result;
+}
+
+static ssize_t spiDevRead(struct file* file, char __user* buffer, size_t count, loff_t* offset)
 {
+	struct spiDevice* spi = spiFromFile(file);
+	unsigned int copied = 0;
 	int result;
-	uint8_t i = 0;
 
-	printk(KERN_INFO "SPI driver: starting\n");
+	count &= ~(sizeof(uint32_t) - 1);
+	if (count == 0)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&spi->transferLock))
+		return -ERESTARTSYS;
+
+	spiDrainRx(spi);
+	while (kfifo_is_empty(&spi->rxBuffer))
+	{
+		mutex_unlock(&spi->transferLock);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(spi->waitQueue, !kfifo_is_empty(&spi->rxBuffer) || !rxFifoIsEmpty(spi)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&spi->transferLock))
+			return -ERESTARTSYS;
+		spiDrainRx(spi);
+	}
+	result = kfifo_to_user(&spi->rxBuffer, buffer, count, &copied);
+
+	mutex_unlock(&spi->transferLock);
+	return result ? result : copied;
+}
+
+// EPOLLIN when received words are waiting, EPOLLOUT once the TX FIFO is empty
+static __poll_t spiDevPoll(struct file* file, poll_table* wait)
+{
+	struct spiDevice* spi = spiFromFile(file);
+	__poll_t mask = 0;
+	uint32_t status;
+
+	poll_wait(file, &spi->waitQueue, wait);
+	status = ioread32(spi->base + OFS_STATUS);
+	if (!kfifo_is_empty(&spi->rxBuffer) || !(status & STATUS_RXFE))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (status & STATUS_TXFE)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+static const struct file_operations spiFops =
+{
+	.owner = THIS_MODULE,
+	.read = spiDevRead,
+	.write = spiDevWrite,
+	.poll = spiDevPoll,
+	.llseek = no_llseek
+};
 
-	// Create qe directory under /sys/kernel
-	kobj = kobject_create_and_add("spi", kernel_kobj);
-	if (!kobj)
+//-----------------------------------------------------------------------------
+// Platform Driver
+//-----------------------------------------------------------------------------
+
+// Uses the spi<n> alias when it is free, the first free index otherwise
+static int spiAllocateId(struct platform_device* pdev)
+{
+	int id = of_alias_get_id(pdev->dev.of_node, "spi");
+	if (id >= 0 && id < MAX_SPI_DEVICES && spiDevices[id] == NULL)
+		return id;
+	for (id = 0; id < MAX_SPI_DEVICES; id++)
+		if (spiDevices[id] == NULL)
+			return id;
+	return -ENOSPC;
+}
+
+static int spiProbe(struct platform_device* pdev)
+{
+	struct spiDevice* spi;
+	struct resource* resource;
+	int result;
+	int id;
+
+	spi = devm_kzalloc(&pdev->dev, sizeof(*spi), GFP_KERNEL);
+	if (spi == NULL)
+		return -ENOMEM;
+
+	// Physical to virtual memory map to access spi registers
+	resource = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	spi->base = (unsigned int*)devm_ioremap_resource(&pdev->dev, resource);
+	if (IS_ERR(spi->base))
+		return PTR_ERR(spi->base);
+
+	spi->irq = platform_get_irq_optional(pdev, 0);
+	if (of_property_read_u32(pdev->dev.of_node, "clock-frequency", &spi->clockFrequency) != 0)
+		spi->clockFrequency = DEFAULT_CLOCK_FREQUENCY;
+	if (of_property_read_u32(pdev->dev.of_node, "fifo-depth", &spi->fifoDepth) != 0)
+		spi->fifoDepth = FIFO_DEPTH;
+	// Bursts need at least one word and no more than the FIFO holds, the word time a clock
+	if (spi->clockFrequency == 0 || spi->fifoDepth == 0 || spi->fifoDepth > FIFO_DEPTH)
 	{
-		printk(KERN_ALERT "SPI driver: failed to create and add kobj\n");
+		dev_err(&pdev->dev, "invalid clock-frequency %u or fifo-depth %u\n", spi->clockFrequency, spi->fifoDepth);
+		return -EINVAL;
+	}
+
+	// Bounce buffer for writes to /dev/spi<n>
+	INIT_KFIFO(spi->rxBuffer);
+	spi->txBuffer = devm_kmalloc(&pdev->dev, TRANSFER_CHUNK_WORDS * sizeof(uint32_t), GFP_KERNEL);
+	if (spi->txBuffer == NULL)
+		return -ENOMEM;
+	mutex_init(&spi->transferLock);
+	spin_lock_init(&spi->controlLock);
+	spin_lock_init(&spi->pendingLock);
+
+	// Completion events come either from the IP interrupt or from polling its status
+	init_waitqueue_head(&spi->waitQueue);
+	INIT_WORK(&spi->notifyWork, notifyWorkHandler);
+	hrtimer_init(&spi->completionTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	spi->completionTimer.function = completionTimerHandler;
+
+	mutex_lock(&devicesLock);
+	id = spiAllocateId(pdev);
+	if (id < 0)
+	{
+		mutex_unlock(&devicesLock);
+		return id;
+	}
+	spi->id = id;
+	snprintf(spi->name, sizeof(spi->name), "spi%u", spi->id);
+
+	// Create spi<n> directory under /sys/kernel
+	spi->kobj = kobject_create_and_add(spi->name, kernel_kobj);
+	if (!spi->kobj)
+	{
+		mutex_unlock(&devicesLock);
+		dev_err(&pdev->dev, "failed to create and add kobj\n");
 		return -ENOENT;
 	}
+	spiDevices[spi->id] = spi;
+	mutex_unlock(&devicesLock);
 
-	result = sysfs_create_group(kobj, &group0);
+	result = sysfs_create_groups(spi->kobj, groups);
 	if (result != 0)
-		return result;
+		goto errorKobj;
 
-	result = sysfs_create_group(kobj, &group1);
-	if (result != 0)
-		return result;
+	if (spi->irq > 0)
+	{
+		result = devm_request_irq(&pdev->dev, spi->irq, spiIsr, 0, spi->name, spi);
+		if (result != 0)
+		{
+			dev_err(&pdev->dev, "failed to request irq %d\n", spi->irq);
+			goto errorKobj;
+		}
+	}
 
-	result = sysfs_create_group(kobj, &group2);
+	spi->miscDevice.minor = MISC_DYNAMIC_MINOR;
+	spi->miscDevice.name = spi->name;
+	spi->miscDevice.fops = &spiFops;
+	spi->miscDevice.mode = 0660;
+	spi->miscDevice.parent = &pdev->dev;
+	result = misc_register(&spi->miscDevice);
 	if (result != 0)
-		return result;
+	{
+		dev_err(&pdev->dev, "failed to register /dev/%s\n", spi->name);
+		goto errorKobj;
+	}
 
-	result = sysfs_create_group(kobj, &group3);
-	if (result != 0)
-		return result;
+	// Statistics are optional, debugfs failures are not fatal
+	spi->debugfsDir = debugfs_create_dir(spi->name, NULL);
+	for (id = 0; id < CS_COUNT; id++)
+	{
+		char name[8];
+		snprintf(name, sizeof(name), "cs%d", id);
+		debugfs_create_file(name, 0444, spi->debugfsDir, &spi->stats[id], &spiStats_fops);
+	}
 
-	// Create a file for each attribute
-	for (; i < 6; i++)
+	platform_set_drvdata(pdev, spi);
+	dev_info(&pdev->dev, "%s initialized\n", spi->name);
+
+	return 0;
+
+errorKobj:
+	mutex_lock(&devicesLock);
+	spiDevices[spi->id] = NULL;
+	mutex_unlock(&devicesLock);
+	kobject_put(spi->kobj);
+	return result;
+}
+
+static int spiRemove(struct platform_device* pdev)
+{
+	struct spiDevice* spi = platform_get_drvdata(pdev);
+
+	misc_deregister(&spi->miscDevice);
+	debugfs_remove_recursive(spi->debugfsDir);
+	spiIrqDisable(spi, TXFE_IRQ_ENABLE | RXNE_IRQ_ENABLE);
+	hrtimer_cancel(&spi->completionTimer);
+	cancel_work_sync(&spi->notifyWork);
+	kobject_put(spi->kobj);
+
+	mutex_lock(&devicesLock);
+	spiDevices[spi->id] = NULL;
+	mutex_unlock(&devicesLock);
+	return 0;
+}
+
+static const struct of_device_id spiOfMatch[] =
+{
+	{ .compatible = "jlosh,spi0-1.0" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, spiOfMatch);
+
+static struct platform_driver spiPlatformDriver =
+{
+	.probe = spiProbe,
+	.remove = spiRemove,
+	.driver =
 	{
-		result = sysfs_create_file(kobj, attrs[i]);
-		if (result != 0)
-			return result;
+		.name = "spi_ip",
+		.of_match_table = spiOfMatch
 	}
+};
 
-	// Physical to virtual memory map to access spi registers
-	base = (unsigned int*)ioremap_nocache(LW_BRIDGE_BASE + SPI_BASE_OFFSET, SPAN_IN_BYTES);
-	if (base == NULL)
-		return -ENODEV;
+//-----------------------------------------------------------------------------
+// Initialization and Exit
+//-----------------------------------------------------------------------------
+
+static int __init initialize_module(void)
+{
+	int result;
+
+	printk(KERN_INFO "SPI driver: starting\n");
+
+	result = platform_driver_register(&spiPlatformDriver);
+	if (result != 0)
+	{
+		printk(KERN_ALERT "SPI driver: failed to register platform driver\n");
+		return result;
+	}
 
 	printk(KERN_INFO "SPI driver: initialized\n");
 
@@ -727,7 +1196,7 @@ static int __init initialize_module(void)
 
 static void __exit exit_module(void)
 {
-	kobject_put(kobj);
+	platform_driver_unregister(&spiPlatformDriver);
 	printk(KERN_INFO "SPI driver: exit\n");
 }
 
@@ -3,14 +3,147 @@
 // Includes, Defines
 
 #include "spi_ip.h"
+#include "spi_model.h"
+#include "spi_profile.h"
 
 // Global variables
 
-uint32_t* base = NULL;
+// volatile keeps the status polling loops below reading the hardware
+volatile uint32_t* base = NULL;
+
+// Last values written to CONTROL and BRD. Configuration changes are computed
+// from these so each one is a single posted write instead of a bridge read
+// followed by a write. spiResync reloads them from the hardware.
+typedef struct _spiShadowRegs
+{
+	uint32_t control;
+	uint32_t brd;
+} spiShadowRegs;
+
+static spiShadowRegs localShadow;
+static spiShadowRegs* shadow = &localShadow;
+
+// Every process using the library shares one lock and one shadow through a
+// POSIX shared memory segment. The mutex is robust, so a process dying inside
+// a transaction cannot wedge the others, and recursive, so library calls can
+// nest inside a transaction held with spiLock.
+#define SHARED_NAME		"/spi_ip"
+#define SHARED_MAGIC	0x53504931
+#define SHARED_WAIT_US	1000000
+
+typedef struct _spiShared
+{
+	uint32_t magic;
+	pthread_mutex_t lock;
+	spiShadowRegs shadow;
+} spiShared;
+
+static spiShared* shared = NULL;
+
+// UIO device the core was opened through, -1 when mapped from /dev/mem
+#define UIO_NAME		"spi-ip"
+#define UIO_TIMEOUT_MS	100
+
+// Slack a transfer allows on top of the wire time before giving up
+#define TRANSFER_STALL_MS	100
+
+static int uioFile = -1;
+
+// Set when the registers are reached through function calls instead of base
+static const spiBackend* backend = NULL;
 
 // Subroutines
 
+static void loadShadow();
+static void openShared();
+static bool openSpiCosim();
+static void writeControl(uint32_t control);
+
+static inline uint32_t readRegister(uint8_t regOffset)
+{
+	PROFILE_BRIDGE_READ();
+	if (backend != NULL)
+		return backend->read(regOffset);
+	return base[regOffset];
+}
+
+static inline void writeRegister(uint8_t regOffset, uint32_t data)
+{
+	PROFILE_BRIDGE_WRITE();
+	if (backend != NULL)
+		backend->write(regOffset, data);
+	else
+		base[regOffset] = data;
+}
+
 bool openSpi()
+{
+	const char* name = getenv("SPI_BACKEND");
+	if (name == NULL || strcmp(name, "mmap") == 0)
+		return openSpiMem();
+	if (strcmp(name, "uio") == 0)
+		return openSpiUio(getenv("SPI_UIO_DEVICE"));
+	if (strcmp(name, "model") == 0)
+		return openSpiBackend(&spiModelBackend);
+	if (strcmp(name, "cosim") == 0)
+		return openSpiCosim();
+	fprintf(stderr, "SPI_BACKEND: unknown backend %s\n", name);
+	return false;
+}
+
+// The co-simulation is a shared library so the tools build without Verilator
+static bool openSpiCosim()
+{
+	const char* path = getenv("SPI_COSIM_LIBRARY");
+	void* library = dlopen(path != NULL ? path : "libspi_cosim.so", RTLD_NOW | RTLD_LOCAL);
+	if (library == NULL)
+	{
+		fprintf(stderr, "%s\n", dlerror());
+		return false;
+	}
+	const spiBackend* cosim = dlsym(library, "spiCosimBackend");
+	// The library links its own copy of the model, so slaves the program
+	// attached with spiModelAttach are handed over to it here. Their contexts
+	// stay in the program's copy, where spiModelSetInputs and the peeks act.
+	bool (*attach)(uint8_t cs, const spiModelSlave* slave) = dlsym(library, "spiModelAttach");
+	bool ok = cosim != NULL && attach != NULL;
+	uint8_t cs, i, count;
+	for (cs = 0; ok && cs < 4; cs++)
+	{
+		const spiModelSlave* slaves = spiModelGetSlaves(cs, &count);
+		for (i = 0; ok && i < count; i++)
+			ok = attach(cs, &slaves[i]);
+	}
+	if (!ok || !openSpiBackend(cosim))
+	{
+		dlclose(library);
+		return false;
+	}
+	return true;
+}
+
+bool openSpiBackend(const spiBackend* newBackend)
+{
+	if (newBackend->open != NULL && !newBackend->open())
+		return false;
+	backend = newBackend;
+	loadShadow();
+	return true;
+}
+
+uint64_t spiBackendCycles()
+{
+	if (backend == NULL || backend->cycles == NULL)
+		return 0;
+	return backend->cycles();
+}
+
+bool spiBackendSimulated()
+{
+	return backend != NULL && backend->simulated != NULL && backend->simulated();
+}
+
+bool openSpiMem()
 {
 	// Open /dev/mem
 	int file = open("/dev/mem", O_RDWR | O_SYNC);
@@ -27,75 +160,301 @@ bool openSpi()
 		// Close /dev/mem
 		close(file);
 	}
+	if (ok)
+	{
+		backend = NULL;
+		loadShadow();
+		openShared();
+	}
 	return ok;
 }
 
+// Longest /dev path findUio returns, a directory entry is at most NAME_MAX long
+#define UIO_DEVICE_SIZE	(sizeof("/dev/") + NAME_MAX)
+
+// Finds /dev/uioN whose name in sysfs is UIO_NAME
+static bool findUio(char* device, size_t size)
+{
+	DIR* dir = opendir("/sys/class/uio");
+	struct dirent* entry;
+	bool found = false;
+	if (dir == NULL)
+		return false;
+	while (!found && (entry = readdir(dir)) != NULL)
+	{
+		char path[sizeof("/sys/class/uio//name") + NAME_MAX];
+		char name[32] = "";
+		snprintf(path, sizeof(path), "/sys/class/uio/%s/name", entry->d_name);
+		FILE* file = fopen(path, "r");
+		if (file == NULL)
+			continue;
+		found = fgets(name, sizeof(name), file) != NULL && strncmp(name, UIO_NAME, strlen(UIO_NAME)) == 0 && name[strlen(UIO_NAME)] == '\n';
+		fclose(file);
+		if (found)
+			found = (size_t)snprintf(device, size, "/dev/%s", entry->d_name) < size;
+	}
+	closedir(dir);
+	return found;
+}
+
+bool openSpiUio(const char* device)
+{
+	char found[UIO_DEVICE_SIZE];
+	uint32_t offset = 0;
+	if (device == NULL)
+	{
+		if (!findUio(found, sizeof(found)))
+			return false;
+		device = found;
+	}
+
+	int file = open(device, O_RDWR);
+	if (file < 0)
+		return false;
+	// Map 0 starts on a page, the registers sit at its offset
+	char path[sizeof("/sys/class/uio//maps/map0/offset") + NAME_MAX];
+	snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map0/offset", strrchr(device, '/') + 1);
+	FILE* offsetFile = fopen(path, "r");
+	if (offsetFile != NULL)
+	{
+		if (fscanf(offsetFile, "%x", &offset) != 1)
+			offset = 0;
+		fclose(offsetFile);
+	}
+	long pageSize = sysconf(_SC_PAGESIZE);
+	uint8_t* map = mmap(NULL, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (map == MAP_FAILED)
+	{
+		close(file);
+		return false;
+	}
+	base = (volatile uint32_t*)(map + offset);
+	uioFile = file;
+	backend = NULL;
+	loadShadow();
+	openShared();
+	return true;
+}
+
+// Sleeps until one of the irq sources in enable is raised. The irq is a level,
+// so a condition that already holds fires as soon as it is enabled. Returns at
+// once when the core was not opened through UIO, the caller then just polls.
+// A UIO device that cannot be read is given up on and the callers poll from
+// then on, rather than spin on a poll() that keeps reporting it readable.
+static void waitIrq(uint32_t enable)
+{
+	uint32_t unmask = 1;
+	uint32_t count;
+	if (uioFile < 0)
+		return;
+	struct pollfd fd = { .fd = uioFile, .events = POLLIN };
+	// uio_pdrv_genirq masks the irq every time it fires
+	if (write(uioFile, &unmask, sizeof(unmask)) != sizeof(unmask))
+		return;
+	writeControl(shadow->control | enable);
+	if (poll(&fd, 1, UIO_TIMEOUT_MS) > 0 && read(uioFile, &count, sizeof(count)) != sizeof(count) && errno != EINTR)
+	{
+		perror("spi_ip: reading the UIO irq count");
+		uioFile = -1;
+	}
+	writeControl(shadow->control & ~enable);
+}
+
+static void loadShadow()
+{
+	shadow->control = readRegister(OFS_CONTROL);
+	shadow->brd = readRegister(OFS_BRD);
+}
+
+// Attaches to the shared segment, creating it if this is the first process.
+// Without it the library keeps working with a private shadow and no locking.
+static void openShared()
+{
+	bool created = true;
+	bool ok;
+	struct stat info;
+	int waited = 0;
+	int file = shm_open(SHARED_NAME, O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (file < 0 && errno == EEXIST)
+	{
+		created = false;
+		file = shm_open(SHARED_NAME, O_RDWR, 0);
+	}
+	if (file < 0)
+		return;
+
+	if (created)
+		ok = (ftruncate(file, sizeof(spiShared)) == 0);
+	else
+	{
+		// The creator may not have sized it yet
+		while ((ok = (fstat(file, &info) == 0 && info.st_size >= 0 && (size_t)info.st_size >= sizeof(spiShared))) == false && waited < SHARED_WAIT_US)
+		{
+			usleep(1000);
+			waited += 1000;
+		}
+	}
+	spiShared* map = ok ? mmap(NULL, sizeof(spiShared), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+	close(file);
+	if (map == MAP_FAILED)
+		return;
+
+	if (created)
+	{
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&map->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		map->shadow = *shadow;
+		__atomic_store_n(&map->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		while (__atomic_load_n(&map->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC && waited < SHARED_WAIT_US)
+		{
+			usleep(1000);
+			waited += 1000;
+		}
+		if (map->magic != SHARED_MAGIC)
+		{
+			munmap(map, sizeof(spiShared));
+			return;
+		}
+	}
+	shared = map;
+	shadow = &map->shadow;
+	// The segment outlives the processes using it, and CONTROL or BRD may
+	// have been changed since by the kernel driver, a bitstream load or devmem
+	if (!created)
+		spiResync();
+}
+
+// Brackets a transaction so no other process can touch the core meanwhile
+void spiLock()
+{
+	PROFILE_SCOPE();
+	if (shared == NULL)
+		return;
+	if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD)
+	{
+		// The owner died mid-transaction, only the hardware can be trusted
+		loadShadow();
+		pthread_mutex_consistent(&shared->lock);
+	}
+}
+
+void spiUnlock()
+{
+	if (shared != NULL)
+		pthread_mutex_unlock(&shared->lock);
+}
+
+// Needed after anything other than this library has written CONTROL or BRD
+void spiResync()
+{
+	spiLock();
+	loadShadow();
+	spiUnlock();
+}
+
+static void writeControl(uint32_t control)
+{
+	shadow->control = control;
+	writeRegister(OFS_CONTROL, control);
+}
+
 uint32_t spiReadRegister(uint8_t regOffset)
 {
-	return *(base + regOffset);
+	PROFILE_SCOPE();
+	return readRegister(regOffset);
 }
 
 void spiWriteRegister(uint8_t regOffset, uint32_t data)
 {
-	*(base + regOffset) = data;
+	PROFILE_SCOPE();
+	spiLock();
+	if (regOffset == OFS_CONTROL)
+		shadow->control = data;
+	else if (regOffset == OFS_BRD)
+		shadow->brd = data;
+	writeRegister(regOffset, data);
+	spiUnlock();
 }
 
 void spiWriteData(uint32_t data)
 {
-	*(base + OFS_DATA) = data;
+	PROFILE_SCOPE();
+	writeRegister(OFS_DATA, data);
 }
 
 uint32_t spiReadData()
 {
-	return *(base + OFS_DATA);
+	PROFILE_SCOPE();
+	return readRegister(OFS_DATA);
 }
 
 void enableCS(uint8_t n)
 {
+	PROFILE_SCOPE();
 	if(n > 3)
 		return;
-	uint32_t cs = spiReadRegister(OFS_CONTROL);
-	spiWriteRegister(OFS_CONTROL, cs | (0x200 << n));
+	spiLock();
+	writeControl(shadow->control | (0x200 << n));
+	spiUnlock();
 }
 
 void disableCS(uint8_t n)
 {
+	PROFILE_SCOPE();
 	if(n > 3)
 		return;
-	uint32_t cs = spiReadRegister(OFS_CONTROL);
-	spiWriteRegister(OFS_CONTROL, cs & ~(0x200 << n));
+	spiLock();
+	writeControl(shadow->control & ~(0x200 << n));
+	spiUnlock();
 }
 
 void csSelect(uint32_t n)
 {
 	if(n > 3)
 		return;
-	uint32_t cs = spiReadRegister(OFS_CONTROL) & ~(0x00006000);
-	spiWriteRegister(OFS_CONTROL, cs | (n << CS_SELECT_OFFSET));
+	spiLock();
+	uint32_t cs = shadow->control & ~(0x00006000);
+	writeControl(cs | (n << CS_SELECT_OFFSET));
+	spiUnlock();
 }
 
 void clearCsSelect()
 {
-	uint32_t cs = spiReadRegister(OFS_CONTROL) & ~(0x00006000);
-	spiWriteRegister(OFS_CONTROL, cs);
+	spiLock();
+	writeControl(shadow->control & ~(0x00006000));
+	spiUnlock();
 }
 
 void enableSpi()
 {
-	*(base + OFS_CONTROL) |= 0x00008000;
+	spiLock();
+	writeControl(shadow->control | CONTROL_ENABLE);
+	spiUnlock();
 }
 
 void disableSpi()
 {
-	*(base + OFS_CONTROL) &= ~0x00008000;
+	spiLock();
+	writeControl(shadow->control & ~CONTROL_ENABLE);
+	spiUnlock();
 }
 
 void spiSetMode(uint8_t n, uint32_t spo_sph)
 {
 	if (n > 3 || spo_sph > 3)
 		return;
-	uint32_t mode = spiReadRegister(OFS_CONTROL) & ~(SPI_MODE_MASK << (SPI_MODE_OFFSET + (n << 1)));
-	spiWriteRegister(OFS_CONTROL, mode | (spo_sph << (SPI_MODE_OFFSET + (n << 1))));
+	spiLock();
+	uint32_t mode = shadow->control & ~(SPI_MODE_MASK << (SPI_MODE_OFFSET + (n << 1)));
+	writeControl(mode | (spo_sph << (SPI_MODE_OFFSET + (n << 1))));
+	spiUnlock();
 }
 
 // The cycle is fixed to 50 MHz
@@ -103,5 +462,190 @@ void spiSetBaudRate(uint32_t baudRate)
 {
 	// Baud Rate = fcycle / divisor
 	uint32_t divisor = (50000000 / 2) / baudRate;
-	spiWriteRegister(OFS_BRD, divisor << 7);
+	spiLock();
+	if (shadow->brd != divisor << 7)
+		spiWriteRegister(OFS_BRD, divisor << 7);
+	spiUnlock();
+}
+
+// Words waiting in the RX FIFO, the pointers wrap so full is told apart by rxff
+uint32_t rxFifoLevel(uint32_t status)
+{
+	if (status & STATUS_RXFF)
+		return FIFO_DEPTH;
+	return ((status >> STATUS_WP_OFFSET) - (status >> STATUS_RP_OFFSET)) & (FIFO_DEPTH - 1);
+}
+
+// Returns once every word written has been shifted out and answered
+void spiWaitTxEmpty()
+{
+	PROFILE_SCOPE();
+	PROFILE_SPIN_START();
+	spiLock();
+	while (!(spiReadRegister(OFS_STATUS) & STATUS_TXFE))
+	{
+		PROFILE_SPIN();
+		waitIrq(TXFE_IRQ_ENABLE);
+	}
+	spiUnlock();
+	PROFILE_SPIN_END();
+}
+
+// Returns once a reply is waiting in the RX FIFO
+void spiWaitRxNotEmpty()
+{
+	PROFILE_SCOPE();
+	PROFILE_SPIN_START();
+	spiLock();
+	while (spiReadRegister(OFS_STATUS) & STATUS_RXFE)
+	{
+		PROFILE_SPIN();
+		waitIrq(RXNE_IRQ_ENABLE);
+	}
+	spiUnlock();
+	PROFILE_SPIN_END();
+}
+
+// Time from now by which the next reply of a transfer must have arrived: a
+// full tx_fifo shifting at the current baud rate and word size, plus
+// TRANSFER_STALL_MS for the scheduler
+static uint64_t transferDeadline()
+{
+	struct timespec now;
+	uint64_t bits = (shadow->control & WORD_SIZE_MASK) + 1;
+	uint64_t wordCycles = (bits * 2 * shadow->brd) >> 7;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec + FIFO_DEPTH * wordCycles * 20
+		+ TRANSFER_STALL_MS * 1000000ULL;
+}
+
+static bool pastDeadline(uint64_t deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec > deadline;
+}
+
+bool spiWaitReply()
+{
+	PROFILE_SCOPE();
+	PROFILE_SPIN_START();
+	bool ok = true;
+	spiLock();
+	uint64_t deadline = transferDeadline();
+	while (true)
+	{
+		uint32_t status = spiReadRegister(OFS_STATUS);
+		if (!(status & STATUS_RXFE))
+			break;
+		// A reply enters rx_fifo as its word leaves tx_fifo
+		if (!(shadow->control & CONTROL_ENABLE) || (status & STATUS_TXFE) || pastDeadline(deadline))
+		{
+			ok = false;
+			break;
+		}
+		PROFILE_SPIN();
+		waitIrq(RXNE_IRQ_ENABLE);
+	}
+	spiUnlock();
+	PROFILE_SPIN_END();
+	return ok;
+}
+
+// Sends n words and collects the n words shifted back, rx[i] answering tx[i].
+// rx may be NULL to throw the replies away. Up to FIFO_DEPTH words are kept in
+// flight: a word stays in tx_fifo while it shifts and its reply lands in
+// rx_fifo, so words written minus replies read never exceeds either FIFO.
+// Returns false when the core is disabled, when tx_fifo has drained with
+// replies still missing, or when no reply comes before the deadline. Words of
+// the transfer may then be left in the FIFOs.
+bool spiTransfer(const uint32_t* tx, uint32_t* rx, uint32_t n)
+{
+	PROFILE_SCOPE();
+	PROFILE_SPIN_START();
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	spiLock();
+	bool ok = shadow->control & CONTROL_ENABLE;
+	uint64_t deadline = transferDeadline();
+	while (ok && received < n)
+	{
+		uint32_t status = spiReadRegister(OFS_STATUS);
+		uint32_t level = rxFifoLevel(status);
+		// A reply enters rx_fifo as its word leaves tx_fifo, so once tx_fifo
+		// is empty every reply still missing has been lost
+		if (level == 0 && sent > received && (status & STATUS_TXFE))
+			ok = false;
+		// Nothing to collect and nothing more that may be sent
+		else if (level == 0 && (sent == n || sent - received == FIFO_DEPTH))
+		{
+			PROFILE_SPIN();
+			if (pastDeadline(deadline))
+				ok = false;
+			else
+				waitIrq(RXNE_IRQ_ENABLE);
+		}
+		if (level > 0)
+			deadline = transferDeadline();
+		while (level-- > 0)
+		{
+			uint32_t data = spiReadData();
+			if (rx != NULL)
+				rx[received] = data;
+			received++;
+		}
+		while (ok && sent < n && sent - received < FIFO_DEPTH)
+			spiWriteData(tx[sent++]);
+	}
+	spiUnlock();
+	PROFILE_SPIN_END();
+	return ok;
+}
+
+// Points the core at a chip select with its mode and word size in one CONTROL
+// write, skipped when nothing changes. Without auto CS the chip select is left
+// high, ready to be pulled low by disableCS. Only safe with nothing in flight.
+void spiConfigure(uint8_t cs, uint8_t mode, uint8_t wordSize, bool csAuto)
+{
+	PROFILE_SCOPE();
+	if (cs > 3 || mode > 3 || wordSize < 1 || wordSize > 32)
+		return;
+	spiLock();
+	uint32_t control = shadow->control;
+	control &= ~(WORD_SIZE_MASK | CS_SELECT_MASK | (CS0_AUTO << cs) | (SPI_MODE_MASK << (SPI_MODE_OFFSET + (cs << 1))));
+	control |= (wordSize - 1) | (cs << CS_SELECT_OFFSET) | (mode << (SPI_MODE_OFFSET + (cs << 1)));
+	if (csAuto)
+		control |= CS0_AUTO << cs;
+	else
+		control |= CS0_MANUAL_HIGH << cs;
+	if (control != shadow->control)
+		writeControl(control);
+	spiUnlock();
+}
+
+// Runs each segment with its own chip select, mode and word size. The core is
+// reconfigured with one CONTROL write between segments, once the previous
+// segment has finished. A segment without auto CS holds CS low throughout.
+// Stops at the first segment whose spiTransfer fails and returns false.
+bool spiTransferSegments(const spiSegment* segments, uint32_t count)
+{
+	PROFILE_SCOPE();
+	uint32_t i;
+	bool ok = true;
+	spiLock();
+	for (i = 0; ok && i < count; i++)
+	{
+		const spiSegment* segment = &segments[i];
+		if (segment->cs > 3 || segment->mode > 3 || segment->wordSize < 1 || segment->wordSize > 32)
+			continue;
+
+		spiConfigure(segment->cs, segment->mode, segment->wordSize, segment->csAuto);
+		if (!segment->csAuto)
+			disableCS(segment->cs);
+		ok = spiTransfer(segment->tx, segment->rx, segment->n);
+		if (!segment->csAuto)
+			enableCS(segment->cs);
+	}
+	spiUnlock();
+	return ok;
 }
@@ -1,5 +1,8 @@
 // Author: Sarker Nadir Afridi Azmi
 
+#ifndef SPI_IP_H_
+#define SPI_IP_H_
+
 // Includes, Defines
 
 #include <stdint.h>
@@ -7,6 +10,17 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
 #include "../address_map.h"
 #include "spi_regs.h"
 
@@ -20,11 +34,71 @@
 #define WORD_SIZE_24BITS	0x17
 #define WORD_SIZE_32BITS	0x1F
 
+#define CS0_MANUAL_HIGH		0x200
+#define CONTROL_ENABLE		0x00008000
+#define WORD_SIZE_MASK		0x1F
+
 #define CS_SELECT_OFFSET	13
+#define CS_SELECT_MASK		0x6000
 #define SPI_MODE_MASK		0x03
 #define SPI_MODE_OFFSET		0x10
 
+// One piece of a vectored transfer
+typedef struct _spiSegment
+{
+	uint8_t cs;
+	uint8_t mode;
+	// Bits per word, 1 to 32
+	uint8_t wordSize;
+	// false holds CS low over the whole segment
+	bool csAuto;
+	const uint32_t* tx;
+	// NULL discards the replies
+	uint32_t* rx;
+	uint32_t n;
+} spiSegment;
+
+// Register access for a core that is not memory mapped, like the model
+typedef struct _spiBackend
+{
+	const char* name;
+	bool (*open)();
+	uint32_t (*read)(uint8_t regOffset);
+	void (*write)(uint8_t regOffset, uint32_t data);
+	// Clock cycles simulated so far, NULL on hardware
+	uint64_t (*cycles)();
+	// True when cycles counts simulated time rather than following the wall
+	// clock, NULL for never
+	bool (*simulated)();
+} spiBackend;
+
+// Opens the backend named by SPI_BACKEND: mmap (the default), uio, model or
+// cosim. uio takes its device from SPI_UIO_DEVICE when set, cosim loads the
+// Verilator build of spi.v from SPI_COSIM_LIBRARY, default libspi_cosim.so.
 bool openSpi();
+// Maps the core from /dev/mem whatever SPI_BACKEND says
+bool openSpiMem();
+// Maps the core through UIO instead of /dev/mem, waits then sleep on the core's
+// irq rather than spinning on STATUS. device is /dev/uioN, or NULL to find the
+// UIO device named spi-ip. The device tree binds it to uio_pdrv_genirq with
+//   spi-ip@ff208000 {
+//       compatible = "generic-uio";
+//       reg = <0xff208000 0x10>;
+//       interrupts = <0 40 4>;
+//   };
+// and uio_pdrv_genirq.of_id=generic-uio on the kernel command line.
+bool openSpiUio(const char* device);
+// The backend is private to this process, the shared lock and shadow are not used
+bool openSpiBackend(const spiBackend* backend);
+// Clock cycles of a simulated core, 0 on hardware
+uint64_t spiBackendCycles();
+// True when spiBackendCycles runs on simulated time, so it measures the core
+// and not the host running the simulation
+bool spiBackendSimulated();
+void spiResync();
+// Hold the core across several calls, the calls themselves lock on their own
+void spiLock();
+void spiUnlock();
 uint32_t spiReadRegister(uint8_t regOffset);
 void spiWriteRegister(uint8_t regOffset, uint32_t data);
 void spiWriteData(uint32_t data);
@@ -36,3 +110,15 @@ void enableSpi();
 void disableSpi();
 void spiSetMode(uint8_t n, uint32_t spo_sph);
 void spiSetBaudRate(uint32_t baudRate);
+uint32_t rxFifoLevel(uint32_t status);
+void spiWaitTxEmpty();
+void spiWaitRxNotEmpty();
+// Waits for a reply like spiWaitRxNotEmpty, but returns false when the core is
+// disabled, when tx_fifo drains with none arriving, or when none comes within
+// the wire time of a full tx_fifo plus a scheduling margin
+bool spiWaitReply();
+void spiConfigure(uint8_t cs, uint8_t mode, uint8_t wordSize, bool csAuto);
+bool spiTransfer(const uint32_t* tx, uint32_t* rx, uint32_t n);
+bool spiTransferSegments(const spiSegment* segments, uint32_t count);
+
+#endif
@@ -0,0 +1,545 @@
+// Author: Sarker Nadir Afridi Azmi
+
+// Includes, Defines
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "spi_model.h"
+
+#define CS_AUTO_OFFSET		5
+
+// MCP23S08 registers and the IOCON bits the model uses
+#define MCP_IODIR			0x00
+#define MCP_IPOL			0x01
+#define MCP_GPINTEN			0x02
+#define MCP_DEFVAL			0x03
+#define MCP_INTCON			0x04
+#define MCP_IOCON			0x05
+#define MCP_INTF			0x07
+#define MCP_INTCAP			0x08
+#define MCP_GPIO			0x09
+#define MCP_OLAT			0x0A
+#define MCP_REG_COUNT		11
+#define MCP_IOCON_HAEN		0x08
+#define MCP_IOCON_SEQOP		0x20
+#define MCP_OPCODE			0x40
+
+typedef struct _modelFifo
+{
+	uint32_t buffer[FIFO_DEPTH];
+	uint8_t rp;
+	uint8_t wp;
+	uint8_t count;
+	bool overflow;
+} modelFifo;
+
+struct _spiModelMcp23s08
+{
+	uint8_t address;
+	uint8_t regs[MCP_REG_COUNT];
+	uint8_t inputs;
+	// Frame state, reset by every CS edge
+	bool selected;
+	bool addressed;
+	bool read;
+	uint8_t byteIndex;
+	uint8_t bitCount;
+	uint8_t inByte;
+	uint8_t outByte;
+	uint8_t pointer;
+};
+
+// Global variables
+
+static pthread_mutex_t modelLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t control;
+static uint32_t brd;
+static modelFifo txFifo;
+static modelFifo rxFifo;
+// The word at the head of tx_fifo is shifting
+static bool shifting;
+// Cycle the current word started, or the earliest the next one may start
+static uint64_t wordStart;
+// CS line levels, high while the core is disabled
+static uint8_t csLevels = 0x0F;
+
+static spiModelSlave slaves[4][MODEL_MAX_SLAVES];
+static uint8_t slaveCount[4];
+static spiModelMcp23s08 expanders[4 * MODEL_MAX_SLAVES];
+static uint8_t expanderCount;
+
+// Model time, either counted per access or taken from the wall clock
+static uint64_t cycles;
+static uint32_t accessCycles;
+static struct timespec openTime;
+
+// Subroutines
+
+//-----------------------------------------------------------------------------
+// MCP23S08
+//-----------------------------------------------------------------------------
+
+static uint8_t mcpPins(const spiModelMcp23s08* mcp)
+{
+	uint8_t iodir = mcp->regs[MCP_IODIR];
+	return (mcp->regs[MCP_OLAT] & ~iodir) | (mcp->inputs & iodir);
+}
+
+// Reading GPIO or INTCAP clears the interrupt
+static uint8_t mcpRead(spiModelMcp23s08* mcp, uint8_t reg)
+{
+	uint8_t value;
+	if (reg == MCP_GPIO)
+		value = mcpPins(mcp) ^ (mcp->regs[MCP_IPOL] & mcp->regs[MCP_IODIR]);
+	else
+		value = mcp->regs[reg];
+	if (reg == MCP_GPIO || reg == MCP_INTCAP)
+		mcp->regs[MCP_INTF] = 0;
+	return value;
+}
+
+static void mcpWrite(spiModelMcp23s08* mcp, uint8_t reg, uint8_t value)
+{
+	if (reg == MCP_INTF || reg == MCP_INTCAP)
+		return;
+	// GPIO writes land in the output latch
+	if (reg == MCP_GPIO)
+		reg = MCP_OLAT;
+	mcp->regs[reg] = value;
+}
+
+static void mcpSelect(void* context, bool selected)
+{
+	spiModelMcp23s08* mcp = context;
+	mcp->selected = selected;
+	mcp->addressed = false;
+	mcp->byteIndex = 0;
+	mcp->bitCount = 0;
+	mcp->outByte = 0;
+}
+
+// Called after every full byte. Byte 0 is the opcode, 1 the register and the
+// rest data, with the pointer stepping through the registers unless SEQOP.
+static void mcpByte(spiModelMcp23s08* mcp, uint8_t byte)
+{
+	if (mcp->byteIndex == 0)
+	{
+		// Without HAEN the address pins are ignored
+		uint8_t address = (mcp->regs[MCP_IOCON] & MCP_IOCON_HAEN) ? mcp->address : (byte >> 1) & 0x03;
+		mcp->addressed = (byte & 0xF8) == MCP_OPCODE && ((byte >> 1) & 0x03) == address;
+		mcp->read = byte & 1;
+	}
+	else if (mcp->addressed)
+	{
+		if (mcp->byteIndex == 1)
+			mcp->pointer = byte < MCP_REG_COUNT ? byte : 0;
+		else
+		{
+			if (!mcp->read)
+				mcpWrite(mcp, mcp->pointer, byte);
+			if (!(mcp->regs[MCP_IOCON] & MCP_IOCON_SEQOP))
+				mcp->pointer = (mcp->pointer + 1) % MCP_REG_COUNT;
+		}
+		if (mcp->read)
+			mcp->outByte = mcpRead(mcp, mcp->pointer);
+	}
+	if (mcp->byteIndex < 255)
+		mcp->byteIndex++;
+}
+
+// SO is only driven while data is being read back
+static bool mcpDriving(const spiModelMcp23s08* mcp)
+{
+	return mcp->selected && mcp->addressed && mcp->read && mcp->byteIndex >= 2;
+}
+
+static bool mcpMisoBit(void* context, bool* driven)
+{
+	spiModelMcp23s08* mcp = context;
+	*driven = mcpDriving(mcp);
+	return *driven && (mcp->outByte >> 7);
+}
+
+static uint32_t mcpExchange(void* context, uint32_t mosi, uint8_t bits, bool* driven)
+{
+	spiModelMcp23s08* mcp = context;
+	uint32_t miso = 0;
+	int i;
+	*driven = false;
+	if (!mcp->selected)
+		return 0;
+	for (i = bits - 1; i >= 0; i--)
+	{
+		bool driving = mcpDriving(mcp);
+		miso = (miso << 1) | (driving ? mcp->outByte >> 7 : 0);
+		*driven |= driving;
+		mcp->outByte <<= 1;
+		mcp->inByte = (mcp->inByte << 1) | ((mosi >> i) & 1);
+		if (++mcp->bitCount == 8)
+		{
+			mcp->bitCount = 0;
+			mcpByte(mcp, mcp->inByte);
+		}
+	}
+	return miso;
+}
+
+// Last MOSI bit per loopback, what a bit-level user sees on MISO next
+static bool loopbackBits[4];
+
+static uint32_t loopbackExchange(void* context, uint32_t mosi, uint8_t bits, bool* driven)
+{
+	*(bool*)context = mosi & 1;
+	*driven = true;
+	return mosi;
+}
+
+static bool loopbackMisoBit(void* context, bool* driven)
+{
+	*driven = true;
+	return *(bool*)context;
+}
+
+bool spiModelAttach(uint8_t cs, const spiModelSlave* slave)
+{
+	if (cs > 3 || slaveCount[cs] == MODEL_MAX_SLAVES)
+		return false;
+	slaves[cs][slaveCount[cs]++] = *slave;
+	return true;
+}
+
+spiModelMcp23s08* spiModelAddMcp23s08(uint8_t cs, uint8_t address)
+{
+	spiModelMcp23s08* mcp;
+	if (cs > 3 || address > 3 || expanderCount == 4 * MODEL_MAX_SLAVES)
+		return NULL;
+	mcp = &expanders[expanderCount];
+	memset(mcp, 0, sizeof(*mcp));
+	mcp->address = address;
+	mcp->regs[MCP_IODIR] = 0xFF;
+	spiModelSlave slave = { .select = mcpSelect, .exchange = mcpExchange, .misoBit = mcpMisoBit, .context = mcp };
+	if (!spiModelAttach(cs, &slave))
+		return NULL;
+	expanderCount++;
+	return mcp;
+}
+
+bool spiModelAddLoopback(uint8_t cs)
+{
+	spiModelSlave slave = { .select = NULL, .exchange = loopbackExchange, .misoBit = loopbackMisoBit, .context = &loopbackBits[cs & 3] };
+	return spiModelAttach(cs, &slave);
+}
+
+// Input changes are captured the way the chip's interrupt logic would
+void spiModelSetInputs(spiModelMcp23s08* mcp, uint8_t pins)
+{
+	pthread_mutex_lock(&modelLock);
+	uint8_t before = mcpPins(mcp);
+	mcp->inputs = pins;
+	uint8_t after = mcpPins(mcp);
+	uint8_t reference = (mcp->regs[MCP_DEFVAL] & mcp->regs[MCP_INTCON]) | (before & ~mcp->regs[MCP_INTCON]);
+	uint8_t flagged = (after ^ reference) & mcp->regs[MCP_GPINTEN] & mcp->regs[MCP_IODIR];
+	if (flagged && mcp->regs[MCP_INTF] == 0)
+		mcp->regs[MCP_INTCAP] = after;
+	mcp->regs[MCP_INTF] |= flagged;
+	pthread_mutex_unlock(&modelLock);
+}
+
+uint8_t spiModelGetOutputs(const spiModelMcp23s08* mcp)
+{
+	return mcp->regs[MCP_OLAT] & ~mcp->regs[MCP_IODIR];
+}
+
+uint8_t spiModelPeekRegister(const spiModelMcp23s08* mcp, uint8_t reg)
+{
+	return reg < MCP_REG_COUNT ? mcp->regs[reg] : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Core
+//-----------------------------------------------------------------------------
+
+static uint64_t now()
+{
+	struct timespec time;
+	if (accessCycles > 0)
+		return cycles;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	uint64_t ns = (time.tv_sec - openTime.tv_sec) * 1000000000ULL + time.tv_nsec - openTime.tv_nsec;
+	return ns * (MODEL_CLOCK_FREQUENCY / 1000000) / 1000;
+}
+
+static bool fifoPush(modelFifo* fifo, uint32_t data)
+{
+	if (fifo->count == FIFO_DEPTH)
+	{
+		fifo->overflow = true;
+		return false;
+	}
+	if (fifo->overflow)
+		return false;
+	fifo->buffer[fifo->wp] = data;
+	fifo->wp = (fifo->wp + 1) % FIFO_DEPTH;
+	fifo->count++;
+	return true;
+}
+
+// Like the RTL an empty FIFO still shows whatever sits at the read pointer
+static uint32_t fifoPop(modelFifo* fifo)
+{
+	uint32_t data = fifo->buffer[fifo->rp];
+	if (fifo->count > 0)
+	{
+		fifo->rp = (fifo->rp + 1) % FIFO_DEPTH;
+		fifo->count--;
+	}
+	return data;
+}
+
+static uint8_t selectedCs()
+{
+	return (control & CS_SELECT_MASK) >> CS_SELECT_OFFSET;
+}
+
+static void setCs(uint8_t n, bool high)
+{
+	uint8_t i;
+	if (((csLevels >> n) & 1) == high)
+		return;
+	csLevels ^= 1 << n;
+	for (i = 0; i < slaveCount[n]; i++)
+		if (slaves[n][i].select != NULL)
+			slaves[n][i].select(slaves[n][i].context, !high);
+}
+
+// CS levels outside of a word: all high while disabled, otherwise a selected
+// manual CS follows its level bit and everything else holds
+static void updateCs()
+{
+	uint8_t n;
+	if (!(control & CONTROL_ENABLE))
+	{
+		for (n = 0; n < 4; n++)
+			setCs(n, true);
+		return;
+	}
+	n = selectedCs();
+	if (!(control & (CS0_AUTO << n)))
+		setCs(n, control & (CS0_MANUAL_HIGH << n));
+}
+
+static uint32_t exchangeWord(uint8_t cs, uint32_t mosi, uint8_t bits)
+{
+	uint32_t miso = 0;
+	uint8_t i;
+	// A slave only sees the clock while its CS is low
+	if ((csLevels >> cs) & 1)
+		return 0;
+	for (i = 0; i < slaveCount[cs]; i++)
+	{
+		bool driven;
+		uint32_t reply = slaves[cs][i].exchange(slaves[cs][i].context, mosi, bits, &driven);
+		if (driven)
+			miso |= reply;
+	}
+	if (bits < 32)
+		miso &= (1u << bits) - 1;
+	return miso;
+}
+
+// Cycles one word spends in TX_RX, each bit is two BRD half periods. BRD is
+// fixed point with 7 fractional bits and below 1.0 the baud generator never
+// toggles, so nothing is ever shifted.
+static uint64_t wordCycles(uint8_t bits)
+{
+	if ((brd >> 7) == 0)
+		return UINT64_MAX / 2;
+	return ((uint64_t)bits * 2 * brd) >> 7;
+}
+
+// Runs the serializer up to time t. A word leaves tx_fifo and its reply enters
+// rx_fifo once its last bit is shifted, then the state machine spends a cycle
+// in IDLE loading the counter and, with any CS auto bit set, one in CS_ASSERT.
+static void advance(uint64_t t)
+{
+	while ((control & CONTROL_ENABLE) && txFifo.count > 0)
+	{
+		uint8_t bits = (control & WORD_SIZE_MASK) + 1;
+		uint8_t cs = selectedCs();
+		bool csAuto = control & (CS0_AUTO << cs);
+		if (!shifting)
+		{
+			uint64_t start = wordStart + ((control & (0x0F << CS_AUTO_OFFSET)) ? 1 : 0);
+			if (start > t)
+				break;
+			wordStart = start;
+			shifting = true;
+			if (csAuto)
+				setCs(cs, false);
+		}
+		uint64_t end = wordStart + wordCycles(bits);
+		if (end > t)
+			break;
+		fifoPush(&rxFifo, exchangeWord(cs, fifoPop(&txFifo), bits));
+		if (csAuto)
+			setCs(cs, true);
+		shifting = false;
+		wordStart = end + 1;
+	}
+}
+
+// Time only moves forward at register accesses, which is all the bus can see
+static uint64_t busAccess()
+{
+	cycles += accessCycles;
+	uint64_t t = now();
+	advance(t);
+	return t;
+}
+
+static uint32_t modelRead(uint8_t regOffset)
+{
+	uint32_t data = 0;
+	pthread_mutex_lock(&modelLock);
+	busAccess();
+	switch (regOffset)
+	{
+		case OFS_DATA:
+			data = fifoPop(&rxFifo);
+			break;
+		case OFS_STATUS:
+			data = rxFifo.overflow ? STATUS_RXFO : 0;
+			data |= rxFifo.count == FIFO_DEPTH ? STATUS_RXFF : 0;
+			data |= rxFifo.count == 0 ? STATUS_RXFE : 0;
+			data |= txFifo.overflow ? STATUS_TXFO : 0;
+			data |= txFifo.count == FIFO_DEPTH ? STATUS_TXFF : 0;
+			data |= txFifo.count == 0 ? STATUS_TXFE : 0;
+			data |= rxFifo.wp << STATUS_WP_OFFSET | rxFifo.rp << STATUS_RP_OFFSET;
+			data |= ((control >> CS_AUTO_OFFSET) & 0x0F) << 16;
+			break;
+		case OFS_CONTROL:
+			data = control;
+			break;
+		case OFS_BRD:
+			data = brd;
+			break;
+	}
+	pthread_mutex_unlock(&modelLock);
+	return data;
+}
+
+static void modelWrite(uint8_t regOffset, uint32_t data)
+{
+	pthread_mutex_lock(&modelLock);
+	uint64_t t = busAccess();
+	switch (regOffset)
+	{
+		case OFS_DATA:
+			// An idle serializer picks the word up on the next cycle
+			if (txFifo.count == 0 && !shifting && wordStart < t + 1)
+				wordStart = t + 1;
+			fifoPush(&txFifo, data);
+			break;
+		case OFS_STATUS:
+			// Overflow flags are write 1 to clear
+			if (data & STATUS_TXFO)
+				txFifo.overflow = false;
+			if (data & STATUS_RXFO)
+				rxFifo.overflow = false;
+			break;
+		case OFS_CONTROL:
+			// Disabling drops the serializer back to IDLE, the word stays queued
+			if (!(data & CONTROL_ENABLE))
+				shifting = false;
+			if (!(control & CONTROL_ENABLE) && (data & CONTROL_ENABLE) && wordStart < t + 1)
+				wordStart = t + 1;
+			control = data;
+			updateCs();
+			break;
+		case OFS_BRD:
+			brd = data;
+			break;
+	}
+	pthread_mutex_unlock(&modelLock);
+}
+
+bool spiModelAttachSlaves()
+{
+	const char* list = getenv("SPI_MODEL_SLAVES");
+	char copy[256];
+	char* entry;
+	char* save;
+	uint8_t n;
+	for (n = 0; n < 4; n++)
+		if (slaveCount[n] > 0)
+			return true;
+	if (list == NULL)
+		list = "0:mcp23s08:0,1:loopback,2:loopback,3:loopback";
+	snprintf(copy, sizeof(copy), "%s", list);
+	for (entry = strtok_r(copy, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save))
+	{
+		char type[16];
+		unsigned int cs, address = 0;
+		bool ok = sscanf(entry, "%u:%15[a-z0-9]:%u", &cs, type, &address) >= 2;
+		if (ok && strcmp(type, "loopback") == 0)
+			ok = spiModelAddLoopback(cs);
+		else if (ok && strcmp(type, "mcp23s08") == 0)
+			ok = spiModelAddMcp23s08(cs, address) != NULL;
+		else
+			ok = false;
+		if (!ok)
+		{
+			fprintf(stderr, "SPI_MODEL_SLAVES: bad entry %s\n", entry);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool modelOpen()
+{
+	const char* step = getenv("SPI_MODEL_CYCLES");
+	accessCycles = step != NULL ? strtoul(step, NULL, 0) : 0;
+	clock_gettime(CLOCK_MONOTONIC, &openTime);
+	return spiModelAttachSlaves();
+}
+
+const spiModelSlave* spiModelGetSlaves(uint8_t cs, uint8_t* count)
+{
+	*count = cs < 4 ? slaveCount[cs] : 0;
+	return cs < 4 ? slaves[cs] : NULL;
+}
+
+// Only a fixed SPI_MODEL_CYCLES per access decouples model time from the wall clock
+static bool modelSimulated()
+{
+	return accessCycles > 0;
+}
+
+uint64_t spiModelCycles()
+{
+	pthread_mutex_lock(&modelLock);
+	uint64_t t = now();
+	pthread_mutex_unlock(&modelLock);
+	return t;
+}
+
+uint8_t spiModelCsLevels()
+{
+	return csLevels;
+}
+
+bool spiModelIrq()
+{
+	pthread_mutex_lock(&modelLock);
+	advance(now());
+	bool irq = (control & CONTROL_ENABLE) && (((control & RXNE_IRQ_ENABLE) && rxFifo.count > 0) || ((control & TXFE_IRQ_ENABLE) && txFifo.count == 0));
+	pthread_mutex_unlock(&modelLock);
+	return irq;
+}
+
+const spiBackend spiModelBackend = { .name = "model", .open = modelOpen, .read = modelRead, .write = modelWrite, .cycles = spiModelCycles, .simulated = modelSimulated };
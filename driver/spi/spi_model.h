@@ -0,0 +1,65 @@
+// Author: Sarker Nadir Afridi Azmi
+
+// Behavioral model of spi.v for running the tools without the board
+// Selected with SPI_BACKEND=model. The model keeps both FIFOs with their
+// overflow and pointer bits, shifts each word in the time BRD gives it, drives
+// the four chip selects the way chipselect_select does and exchanges words
+// with the slaves attached to each chip select. MISO is the OR of the slaves
+// that drive it, 0 when none do.
+//
+// Environment:
+//   SPI_MODEL_SLAVES  cs:type[:address],... with type loopback or mcp23s08,
+//                     default 0:mcp23s08:0,1:loopback,2:loopback,3:loopback
+//   SPI_MODEL_CYCLES  clock cycles each register access takes. Unset, model
+//                     time follows the wall clock at 50 MHz instead.
+
+#ifndef SPI_MODEL_H_
+#define SPI_MODEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spi_ip.h"
+
+#define MODEL_CLOCK_FREQUENCY	50000000
+#define MODEL_MAX_SLAVES		4
+
+// A device on one chip select
+typedef struct _spiModelSlave
+{
+	// Chip select edges, selected is true while CS is low
+	void (*select)(void* context, bool selected);
+	// Shifts one word of bits bits both ways, MSB first. Returns the MISO
+	// word and sets *driven when the slave drove MISO.
+	uint32_t (*exchange)(void* context, uint32_t mosi, uint8_t bits, bool* driven);
+	// MISO level for the coming bit, for bit-level users like the co-simulation,
+	// which then calls exchange one bit at a time. May be NULL.
+	bool (*misoBit)(void* context, bool* driven);
+	void* context;
+} spiModelSlave;
+
+typedef struct _spiModelMcp23s08 spiModelMcp23s08;
+
+extern const spiBackend spiModelBackend;
+
+// Slaves are attached before openSpi, in place of SPI_MODEL_SLAVES. With
+// SPI_BACKEND=cosim openSpi passes them on to the co-simulation.
+bool spiModelAttach(uint8_t cs, const spiModelSlave* slave);
+// Builds the slaves from SPI_MODEL_SLAVES unless some are already attached
+bool spiModelAttachSlaves();
+const spiModelSlave* spiModelGetSlaves(uint8_t cs, uint8_t* count);
+spiModelMcp23s08* spiModelAddMcp23s08(uint8_t cs, uint8_t address);
+bool spiModelAddLoopback(uint8_t cs);
+// Levels on the expander's pins, only the pins set as inputs are seen
+void spiModelSetInputs(spiModelMcp23s08* mcp, uint8_t pins);
+// Levels driven on the pins set as outputs
+uint8_t spiModelGetOutputs(const spiModelMcp23s08* mcp);
+uint8_t spiModelPeekRegister(const spiModelMcp23s08* mcp, uint8_t reg);
+
+// Clock cycles since the model was opened
+uint64_t spiModelCycles();
+// CS line levels, bit n for CS n, 1 is high
+uint8_t spiModelCsLevels();
+// Level of the irq output
+bool spiModelIrq();
+
+#endif
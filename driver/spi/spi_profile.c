@@ -0,0 +1,226 @@
+// Author: Sarker Nadir Afridi Azmi
+
+// Includes, Defines
+
+// For dladdr
+#define _GNU_SOURCE
+#include "spi_profile.h"
+
+#ifdef SPI_IP_PROFILE
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <dlfcn.h>
+
+#define PROFILE_SITES		64
+
+typedef struct _profileSite
+{
+	const char* name;
+	void* caller;
+	uint64_t calls;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t histogram[PROFILE_BUCKETS];
+} profileSite;
+
+// Global variables
+
+uint64_t spiProfileBridgeReads = 0;
+uint64_t spiProfileBridgeWrites = 0;
+
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+static profileSite sites[PROFILE_SITES];
+static uint32_t siteCount = 0;
+static uint64_t waits = 0;
+static uint64_t spins = 0;
+static uint64_t spinHistogram[PROFILE_BUCKETS];
+
+// PMCCNTR is readable from user space only once a kernel module has set
+// PMUSERENR, so the first read is tried under a SIGILL handler
+static bool usePmu = false;
+#if defined(__arm__)
+static sigjmp_buf probeJump;
+#endif
+
+// Subroutines
+
+static unsigned int bucket(uint64_t value)
+{
+	unsigned int i = 0;
+	while (value > 1 && i < PROFILE_BUCKETS - 1)
+	{
+		value >>= 1;
+		i++;
+	}
+	return i;
+}
+
+#if defined(__arm__)
+static inline uint32_t readPmu()
+{
+	uint32_t count;
+	__asm__ volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(count));
+	return count;
+}
+
+static void probeFailed(int signal)
+{
+	siglongjmp(probeJump, 1);
+}
+#endif
+
+static void probePmu()
+{
+#if defined(__arm__)
+	struct sigaction action, old;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = probeFailed;
+	sigaction(SIGILL, &action, &old);
+	if (sigsetjmp(probeJump, 1) == 0)
+	{
+		uint32_t first = readPmu();
+		// A counter that is readable but stopped is no use either
+		usePmu = readPmu() != first;
+	}
+	sigaction(SIGILL, &old, NULL);
+#endif
+}
+
+// The PMU counter is 32 bits, durations are taken modulo 2^32 to match
+uint64_t spiProfileNow()
+{
+#if defined(__arm__)
+	if (usePmu)
+		return readPmu();
+#endif
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static profileSite* findSite(const char* name, void* caller)
+{
+	uint32_t i;
+	for (i = 0; i < siteCount; i++)
+		if (sites[i].caller == caller && sites[i].name == name)
+			return &sites[i];
+	if (siteCount == PROFILE_SITES)
+		return NULL;
+	profileSite* site = &sites[siteCount++];
+	site->name = name;
+	site->caller = caller;
+	site->min = UINT64_MAX;
+	return site;
+}
+
+void spiProfileLeave(spiProfileScope* scope)
+{
+	uint64_t elapsed = spiProfileNow() - scope->start;
+	if (usePmu)
+		elapsed = (uint32_t)elapsed;
+	pthread_mutex_lock(&profileLock);
+	profileSite* site = findSite(scope->site, scope->caller);
+	if (site != NULL)
+	{
+		site->calls++;
+		site->total += elapsed;
+		if (elapsed < site->min)
+			site->min = elapsed;
+		if (elapsed > site->max)
+			site->max = elapsed;
+		site->histogram[bucket(elapsed)]++;
+	}
+	pthread_mutex_unlock(&profileLock);
+}
+
+void spiProfileSpins(uint32_t count)
+{
+	pthread_mutex_lock(&profileLock);
+	waits++;
+	spins += count;
+	spinHistogram[bucket(count)]++;
+	pthread_mutex_unlock(&profileLock);
+}
+
+static void dumpHistogram(FILE* file, const uint64_t* histogram)
+{
+	unsigned int i;
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+		if (histogram[i])
+			fprintf(file, "  %llu %llu\n", i == 0 ? 0ULL : 1ULL << i, (unsigned long long)histogram[i]);
+}
+
+void spiProfileDump(FILE* file)
+{
+	uint32_t i;
+	pthread_mutex_lock(&profileLock);
+	fprintf(file, "spi_ip profile, times in %s\n", usePmu ? "cycles" : "ns");
+	fprintf(file, "bridge_reads %llu\n", (unsigned long long)__atomic_load_n(&spiProfileBridgeReads, __ATOMIC_RELAXED));
+	fprintf(file, "bridge_writes %llu\n", (unsigned long long)__atomic_load_n(&spiProfileBridgeWrites, __ATOMIC_RELAXED));
+	fprintf(file, "poll_waits %llu\n", (unsigned long long)waits);
+	fprintf(file, "poll_spins %llu\n", (unsigned long long)spins);
+	fprintf(file, "spins_per_wait count\n");
+	dumpHistogram(file, spinHistogram);
+	for (i = 0; i < siteCount; i++)
+	{
+		const profileSite* site = &sites[i];
+		Dl_info info;
+		const char* caller = "?";
+		uintptr_t offset = (uintptr_t)site->caller;
+		if (dladdr(site->caller, &info) != 0)
+		{
+			if (info.dli_sname != NULL)
+			{
+				caller = info.dli_sname;
+				offset -= (uintptr_t)info.dli_saddr;
+			}
+			else if (info.dli_fname != NULL)
+			{
+				caller = info.dli_fname;
+				offset -= (uintptr_t)info.dli_fbase;
+			}
+		}
+		fprintf(file, "site %s from %s+0x%lx calls %llu total %llu min %llu mean %llu max %llu\n", site->name, caller,
+			(unsigned long)offset, (unsigned long long)site->calls, (unsigned long long)site->total,
+			(unsigned long long)site->min, (unsigned long long)(site->total / site->calls), (unsigned long long)site->max);
+		dumpHistogram(file, site->histogram);
+	}
+	pthread_mutex_unlock(&profileLock);
+}
+
+void spiProfileReset()
+{
+	pthread_mutex_lock(&profileLock);
+	memset(sites, 0, sizeof(sites));
+	siteCount = 0;
+	waits = 0;
+	spins = 0;
+	memset(spinHistogram, 0, sizeof(spinHistogram));
+	__atomic_store_n(&spiProfileBridgeReads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&spiProfileBridgeWrites, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&profileLock);
+}
+
+static void dumpAtExit()
+{
+	const char* path = getenv("SPI_IP_PROFILE_FILE");
+	FILE* file = path != NULL ? fopen(path, "w") : NULL;
+	spiProfileDump(file != NULL ? file : stderr);
+	if (file != NULL)
+		fclose(file);
+}
+
+__attribute__((constructor)) static void startProfile()
+{
+	probePmu();
+	atexit(dumpAtExit);
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef SPI_PROFILE_H_
+#define SPI_PROFILE_H_
+
+// Hot path profiling for spi_ip, compiled in with -DSPI_IP_PROFILE, which
+// "make tools PROFILE=1" sets. Each instrumented function records its calls
+// and durations per caller, along with bridge reads and writes and the status
+// polls spent waiting. Durations come from the Cortex-A9 cycle counter when
+// user access to it is enabled, else from clock_gettime in ns. The profile is
+// printed at exit to stderr or to the file named by SPI_IP_PROFILE_FILE.
+// Callers show as file+offset for addr2line unless linked with -rdynamic.
+// Without SPI_IP_PROFILE every hook below expands to nothing.
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Bucket i counts values in [2^i, 2^(i+1)), bucket 0 takes 0 as well
+#define PROFILE_BUCKETS		32
+
+#ifdef SPI_IP_PROFILE
+
+typedef struct _spiProfileScope
+{
+	const char* site;
+	void* caller;
+	uint64_t start;
+} spiProfileScope;
+
+extern uint64_t spiProfileBridgeReads;
+extern uint64_t spiProfileBridgeWrites;
+
+uint64_t spiProfileNow();
+void spiProfileLeave(spiProfileScope* scope);
+void spiProfileSpins(uint32_t spins);
+void spiProfileDump(FILE* file);
+void spiProfileReset();
+
+// Times the rest of the enclosing function, however it returns
+#define PROFILE_SCOPE()			spiProfileScope profileScope __attribute__((cleanup(spiProfileLeave))) = \
+									{ __func__, __builtin_return_address(0), spiProfileNow() }
+#define PROFILE_BRIDGE_READ()	__atomic_fetch_add(&spiProfileBridgeReads, 1, __ATOMIC_RELAXED)
+#define PROFILE_BRIDGE_WRITE()	__atomic_fetch_add(&spiProfileBridgeWrites, 1, __ATOMIC_RELAXED)
+// Status polls that found nothing to do, recorded once per wait
+#define PROFILE_SPIN_START()	uint32_t profileSpins = 0
+#define PROFILE_SPIN()			profileSpins++
+#define PROFILE_SPIN_END()		spiProfileSpins(profileSpins)
+
+#else
+
+#define PROFILE_SCOPE()
+#define PROFILE_BRIDGE_READ()
+#define PROFILE_BRIDGE_WRITE()
+#define PROFILE_SPIN_START()
+#define PROFILE_SPIN()
+#define PROFILE_SPIN_END()
+
+static inline void spiProfileDump(FILE* file)
+{
+}
+
+static inline void spiProfileReset()
+{
+}
+
+#endif
+
+#endif
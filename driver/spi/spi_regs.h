@@ -8,4 +8,21 @@
 
 #define SPAN_IN_BYTES	16
 
+// Status register bits
+#define STATUS_RXFO			0x00000001
+#define STATUS_RXFF			0x00000002
+#define STATUS_RXFE			0x00000004
+#define STATUS_TXFO			0x00000008
+#define STATUS_TXFF			0x00000010
+#define STATUS_TXFE			0x00000020
+#define STATUS_WP_OFFSET	8
+#define STATUS_RP_OFFSET	12
+
+// Interrupt enables in the control register, the irq output is a level
+#define RXNE_IRQ_ENABLE		0x01000000
+#define TXFE_IRQ_ENABLE		0x02000000
+
+// Both FIFOs in the IP are 16 words deep
+#define FIFO_DEPTH		16
+
 #endif
@@ -0,0 +1,53 @@
+#ifndef SPI_STATS_H_
+#define SPI_STATS_H_
+
+// Per chip select transfer statistics shown in debugfs
+
+#include <linux/log2.h>       // ilog2
+#include <linux/seq_file.h>   // seq_printf
+#include <linux/debugfs.h>    // DEFINE_SHOW_ATTRIBUTE
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) ns
+#define LATENCY_BUCKETS		32
+
+struct spiStats
+{
+	unsigned long transfers;
+	unsigned long words;
+	unsigned long pollSpins;
+	u64 busyNs;
+	unsigned long latency[LATENCY_BUCKETS];
+};
+
+static inline void spiStatsRecord(struct spiStats* stats, size_t words, unsigned int pollSpins, u64 latencyNs)
+{
+	unsigned int bucket = latencyNs ? ilog2(latencyNs) : 0;
+	stats->transfers++;
+	stats->words += words;
+	stats->pollSpins += pollSpins;
+	stats->busyNs += latencyNs;
+	stats->latency[min_t(unsigned int, bucket, LATENCY_BUCKETS - 1)]++;
+}
+
+// Named for DEFINE_SHOW_ATTRIBUTE below
+static int spiStats_show(struct seq_file* file, void* unused)
+{
+	struct spiStats* stats = file->private;
+	u64 wordsPerSecond = stats->busyNs ? div64_u64((u64)stats->words * NSEC_PER_SEC, stats->busyNs) : 0;
+	unsigned int i;
+
+	seq_printf(file, "transfers %lu\n", stats->transfers);
+	seq_printf(file, "words %lu\n", stats->words);
+	seq_printf(file, "poll_spins %lu\n", stats->pollSpins);
+	seq_printf(file, "busy_ns %llu\n", stats->busyNs);
+	seq_printf(file, "words_per_second %llu\n", wordsPerSecond);
+	seq_printf(file, "latency_ns count\n");
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		if (stats->latency[i])
+			seq_printf(file, "%llu %lu\n", 1ULL << i, stats->latency[i]);
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(spiStats);
+
+#endif
@@ -0,0 +1,73 @@
+// SPI IP tracepoints
+// Sarker Nadir Afridi Azmi
+
+// A transfer on /dev/spi<n> goes through submit, first word written,
+// last word received and complete. Enable them with
+//   echo 1 > /sys/kernel/debug/tracing/events/spi_ip/enable
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM spi_ip
+
+#if !defined(SPI_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define SPI_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(spi_transfer,
+	TP_PROTO(unsigned int id, unsigned int cs, size_t words),
+	TP_ARGS(id, cs, words),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, cs)
+		__field(size_t, words)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->cs = cs;
+		__entry->words = words;
+	),
+	TP_printk("spi%u cs=%u words=%zu", __entry->id, __entry->cs, __entry->words)
+);
+
+DEFINE_EVENT(spi_transfer, spi_submit,
+	TP_PROTO(unsigned int id, unsigned int cs, size_t words),
+	TP_ARGS(id, cs, words)
+);
+
+DEFINE_EVENT(spi_transfer, spi_first_word,
+	TP_PROTO(unsigned int id, unsigned int cs, size_t words),
+	TP_ARGS(id, cs, words)
+);
+
+DEFINE_EVENT(spi_transfer, spi_last_word,
+	TP_PROTO(unsigned int id, unsigned int cs, size_t words),
+	TP_ARGS(id, cs, words)
+);
+
+TRACE_EVENT(spi_complete,
+	TP_PROTO(unsigned int id, unsigned int cs, size_t words, unsigned int pollSpins, u64 latencyNs),
+	TP_ARGS(id, cs, words, pollSpins, latencyNs),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, cs)
+		__field(size_t, words)
+		__field(unsigned int, pollSpins)
+		__field(u64, latencyNs)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->cs = cs;
+		__entry->words = words;
+		__entry->pollSpins = pollSpins;
+		__entry->latencyNs = latencyNs;
+	),
+	TP_printk("spi%u cs=%u words=%zu poll_spins=%u latency_ns=%llu",
+		__entry->id, __entry->cs, __entry->words, __entry->pollSpins, __entry->latencyNs)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE spi_trace
+#include <trace/define_trace.h>
@@ -6,14 +6,331 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "spi_ip.h"
 
+// Batch mode runs a whole script against one mapping, one command per line:
+//   r <offset>                 read a register, DATA pops the RX FIFO
+//   w <offset> <value>         write a register, DATA pushes the TX FIFO
+//   d <value> ...              push words into the TX FIFO
+//   x <value> ...              transfer words and read back the replies, fails
+//                              when the core is disabled or a reply never comes
+//   wait [!]<flag> [timeout]   poll STATUS until a flag is set, or clear with !,
+//                              flags rxfo rxff rxfe txfo txff txfe or a mask,
+//                              timeout in ms, default 1000
+//   sleep <us>
+//   loop <count> ... end       repeat the commands in between, may nest
+// Values take C prefixes, # starts a comment. Each read prints one line of hex
+// words, nothing else is printed unless a command fails.
+
+#define MAX_WORDS		256
+#define MAX_NESTING		16
+#define WAIT_TIMEOUT_MS	1000
+
+typedef enum _batchOp
+{
+	OP_READ,
+	OP_WRITE,
+	OP_PUSH,
+	OP_TRANSFER,
+	OP_WAIT,
+	OP_SLEEP,
+	OP_LOOP,
+	OP_END
+} batchOp;
+
+typedef struct _batchCommand
+{
+	batchOp op;
+	uint32_t line;
+	uint8_t offset;
+	// OP_WAIT: STATUS & mask must equal value
+	uint32_t mask;
+	uint32_t value;
+	// OP_LOOP: repetitions, OP_END: index of its loop, OP_SLEEP: microseconds,
+	// OP_WAIT: timeout in ms
+	uint32_t count;
+	// OP_PUSH and OP_TRANSFER: words in the shared word pool
+	uint32_t first;
+	uint32_t n;
+} batchCommand;
+
+static const struct
+{
+	const char* name;
+	uint32_t mask;
+} statusFlags[] =
+{
+	{ "rxfo", STATUS_RXFO }, { "rxff", STATUS_RXFF }, { "rxfe", STATUS_RXFE },
+	{ "txfo", STATUS_TXFO }, { "txff", STATUS_TXFF }, { "txfe", STATUS_TXFE }
+};
+
+static batchCommand* commands = NULL;
+static uint32_t commandCount = 0;
+static uint32_t* words = NULL;
+static uint32_t wordCount = 0;
+
+static bool parseNumber(const char* text, uint32_t* value)
+{
+	char* end;
+	if (text == NULL)
+		return false;
+	*value = strtoul(text, &end, 0);
+	return *text != '\0' && *end == '\0';
+}
+
+static bool parseFlag(const char* text, batchCommand* command)
+{
+	uint32_t i;
+	bool clear = text != NULL && text[0] == '!';
+	if (text == NULL)
+		return false;
+	if (clear)
+		text++;
+	command->mask = 0;
+	for (i = 0; i < sizeof(statusFlags) / sizeof(statusFlags[0]); i++)
+		if (strcmp(text, statusFlags[i].name) == 0)
+			command->mask = statusFlags[i].mask;
+	if (command->mask == 0 && (!parseNumber(text, &command->mask) || command->mask == 0))
+		return false;
+	command->value = clear ? 0 : command->mask;
+	return true;
+}
+
+static bool addWords(batchCommand* command, char* save)
+{
+	char* token;
+	command->first = wordCount;
+	command->n = 0;
+	while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+	{
+		uint32_t* grown = realloc(words, (wordCount + 1) * sizeof(uint32_t));
+		if (grown == NULL || command->n == MAX_WORDS)
+			return false;
+		words = grown;
+		if (!parseNumber(token, &words[wordCount]))
+			return false;
+		wordCount++;
+		command->n++;
+	}
+	return command->n > 0;
+}
+
+// Reads the whole script first so loops can jump back
+static bool parseScript(FILE* file)
+{
+	char* line = NULL;
+	size_t size = 0;
+	uint32_t lineNumber = 0;
+	uint32_t loops[MAX_NESTING];
+	uint32_t depth = 0;
+	bool ok = true;
+
+	while (ok && getline(&line, &size, file) >= 0)
+	{
+		char* save;
+		char* comment = strchr(line, '#');
+		lineNumber++;
+		if (comment != NULL)
+			*comment = '\0';
+		char* name = strtok_r(line, " \t\r\n", &save);
+		if (name == NULL)
+			continue;
+
+		batchCommand* grown = realloc(commands, (commandCount + 1) * sizeof(batchCommand));
+		if (grown == NULL)
+		{
+			ok = false;
+			break;
+		}
+		commands = grown;
+		batchCommand* command = &commands[commandCount];
+		memset(command, 0, sizeof(*command));
+		command->line = lineNumber;
+		uint32_t value = 0;
+
+		if (strcmp(name, "r") == 0 || strcmp(name, "w") == 0)
+		{
+			command->op = (name[0] == 'r') ? OP_READ : OP_WRITE;
+			ok = parseNumber(strtok_r(NULL, " \t\r\n", &save), &value) && value <= OFS_BRD;
+			command->offset = value;
+			if (ok && command->op == OP_WRITE)
+				ok = parseNumber(strtok_r(NULL, " \t\r\n", &save), &command->value);
+		}
+		else if (strcmp(name, "d") == 0 || strcmp(name, "x") == 0)
+		{
+			command->op = (name[0] == 'd') ? OP_PUSH : OP_TRANSFER;
+			ok = addWords(command, save);
+		}
+		else if (strcmp(name, "wait") == 0)
+		{
+			char* timeout;
+			command->op = OP_WAIT;
+			ok = parseFlag(strtok_r(NULL, " \t\r\n", &save), command);
+			timeout = strtok_r(NULL, " \t\r\n", &save);
+			command->count = WAIT_TIMEOUT_MS;
+			if (ok && timeout != NULL)
+				ok = parseNumber(timeout, &command->count);
+		}
+		else if (strcmp(name, "sleep") == 0)
+		{
+			command->op = OP_SLEEP;
+			ok = parseNumber(strtok_r(NULL, " \t\r\n", &save), &command->count);
+		}
+		else if (strcmp(name, "loop") == 0)
+		{
+			command->op = OP_LOOP;
+			ok = parseNumber(strtok_r(NULL, " \t\r\n", &save), &command->count) && depth < MAX_NESTING;
+			if (ok)
+				loops[depth++] = commandCount;
+		}
+		else if (strcmp(name, "end") == 0)
+		{
+			command->op = OP_END;
+			ok = depth > 0;
+			if (ok)
+				command->count = loops[--depth];
+		}
+		else
+			ok = false;
+
+		if (!ok)
+			fprintf(stderr, "line %u: bad command\n", lineNumber);
+		commandCount++;
+	}
+	if (ok && depth > 0)
+	{
+		fprintf(stderr, "line %u: loop without end\n", commands[loops[depth - 1]].line);
+		ok = false;
+	}
+	free(line);
+	return ok;
+}
+
+static uint64_t nowMs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static bool runScript()
+{
+	// Passes left for each active loop, indexed by nesting depth
+	uint32_t remaining[MAX_NESTING];
+	uint32_t depth = 0;
+	uint32_t replies[MAX_WORDS];
+	uint32_t pc = 0;
+	uint32_t i;
+
+	while (pc < commandCount)
+	{
+		const batchCommand* command = &commands[pc];
+		switch (command->op)
+		{
+			case OP_READ:
+				printf("%08x\n", command->offset == OFS_DATA ? spiReadData() : spiReadRegister(command->offset));
+				break;
+			case OP_WRITE:
+				if (command->offset == OFS_DATA)
+					spiWriteData(command->value);
+				else
+					spiWriteRegister(command->offset, command->value);
+				break;
+			case OP_PUSH:
+				for (i = 0; i < command->n; i++)
+					spiWriteData(words[command->first + i]);
+				break;
+			case OP_TRANSFER:
+				if (!spiTransfer(&words[command->first], replies, command->n))
+				{
+					fflush(stdout);
+					fprintf(stderr, "line %u: transfer failed, core %s, status 0x%08x\n", command->line,
+						(spiReadRegister(OFS_CONTROL) & CONTROL_ENABLE) ? "enabled" : "disabled", spiReadRegister(OFS_STATUS));
+					return false;
+				}
+				for (i = 0; i < command->n; i++)
+					printf("%08x%c", replies[i], (i + 1 == command->n) ? '\n' : ' ');
+				break;
+			case OP_WAIT:
+			{
+				uint64_t start = nowMs();
+				while ((spiReadRegister(OFS_STATUS) & command->mask) != command->value)
+				{
+					if (nowMs() - start >= command->count)
+					{
+						fflush(stdout);
+						fprintf(stderr, "line %u: wait timed out, status 0x%08x\n", command->line, spiReadRegister(OFS_STATUS));
+						return false;
+					}
+				}
+				break;
+			}
+			case OP_SLEEP:
+				usleep(command->count);
+				break;
+			case OP_LOOP:
+				// A loop of 0 skips straight past its end
+				if (command->count == 0)
+				{
+					uint32_t nesting = 0;
+					while (++pc < commandCount && !(commands[pc].op == OP_END && nesting == 0))
+						nesting += (commands[pc].op == OP_LOOP) - (commands[pc].op == OP_END);
+					break;
+				}
+				remaining[depth++] = command->count;
+				break;
+			case OP_END:
+				if (--remaining[depth - 1] > 0)
+					pc = command->count;
+				else
+					depth--;
+				break;
+		}
+		pc++;
+	}
+	return true;
+}
+
+static int runBatch(const char* path)
+{
+	FILE* file = (path == NULL || strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	bool ok;
+	if (file == NULL)
+	{
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	ok = parseScript(file);
+	if (file != stdin)
+		fclose(file);
+	if (!ok)
+		return EXIT_FAILURE;
+
+	if (!openSpi())
+	{
+		fprintf(stderr, "Error opening the SPI IP module\n");
+		return EXIT_FAILURE;
+	}
+	// Output is flushed once at exit rather than per line
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	ok = runScript();
+	free(commands);
+	free(words);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char* argv[])
 {
+	if (argc >= 2 && strcmp(argv[1], "batch") == 0)
+		return runBatch(argc >= 3 ? argv[2] : NULL);
+
 	if(argc < 3)
 	{
 		printf("Usage: %s <r/w> <register offset> <data>\n", argv[0]);
+		printf("       %s batch [script, - or none for stdin]\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
@@ -23,6 +23,10 @@ module fifo #(parameter N = 16, parameter M = 32)
 	assign wp_debug_out = wp;
 	assign data_out = buffer[rp];
 	
+	wire push, pop;
+	assign pop = chipselect && read && !fe;
+	assign push = chipselect && write && !ff && !ov;
+	
 	// Overflow Block
 	always @ (posedge clk)
 	begin
@@ -56,18 +60,21 @@ module fifo #(parameter N = 16, parameter M = 32)
 		end
 		else
 		begin
-			if(chipselect && read && !fe)
-			begin
+			// A push and a pop in the same cycle both take effect, the
+			// serializer pops the TX FIFO and pushes the RX FIFO while the
+			// bus may be accessing the other end
+			if(pop)
 				// data_out <= buffer[rp];
 				rp <= rp + 1'b1;
-				pd <= pd - 1'b1;
-			end
-		else if(chipselect && write && !ff && !ov)
+			if(push)
 			begin
 				buffer[wp] <= data_in;
 				wp <= wp + 1'b1;
-				pd <= pd + 1'b1;
 			end
+			if(push && !pop)
+				pd <= pd + 1'b1;
+			else if(pop && !push)
+				pd <= pd - 1'b1;
 		end
 	end
 
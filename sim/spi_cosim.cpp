@@ -0,0 +1,218 @@
+// Author: Sarker Nadir Afridi Azmi
+
+// Co-simulation of spi.v behind the spi_ip register accessors
+// sim/makefile builds this with a Verilator model of the RTL into
+// libspi_cosim.so, which spi_ip.c loads for SPI_BACKEND=cosim. Accesses are
+// run with the Avalon timing of spi0_hw.tcl: a read is held for two cycles
+// and sampled at the end of the second, a write lasts one cycle, and at least
+// one idle cycle follows each so the core's edge detectors see a new access.
+// The slaves the program attached, or else those named by SPI_MODEL_SLAVES,
+// are clocked bit by bit from the chip selects, baud_out and tx, and drive rx
+// between sampling edges.
+//
+// Environment:
+//   SPI_COSIM_IDLE   idle cycles after each access, default 1
+//   SPI_COSIM_STATS  when set, cycle and access counts are printed at exit
+
+// Includes, Defines
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include "verilated.h"
+#include "Vspi.h"
+
+extern "C"
+{
+#include "spi_model.h"
+}
+
+#define RESET_CYCLES	4
+
+// Global variables
+
+static VerilatedContext* context = nullptr;
+static Vspi* core = nullptr;
+static std::mutex cosimLock;
+
+static uint64_t cycles = 0;
+static uint64_t reads = 0;
+static uint64_t writes = 0;
+static uint32_t idleCycles = 1;
+
+// Last value written to CONTROL, for the clock phase of the selected CS
+static uint32_t control = 0;
+static uint8_t csLevels = 0x0F;
+static bool baudLevel = false;
+
+// Subroutines
+
+static uint8_t csPins()
+{
+	return core->cs_0 | (core->cs_1 << 1) | (core->cs_2 << 2) | (core->cs_3 << 3);
+}
+
+// OR of every slave on a low chip select that drives MISO
+static void driveMiso()
+{
+	bool miso = false;
+	uint8_t n, i, count;
+	for (n = 0; n < 4; n++)
+	{
+		if ((csLevels >> n) & 1)
+			continue;
+		const spiModelSlave* slaves = spiModelGetSlaves(n, &count);
+		for (i = 0; i < count; i++)
+		{
+			bool driven = false;
+			bool bit = slaves[i].misoBit != nullptr && slaves[i].misoBit(slaves[i].context, &driven);
+			if (driven)
+				miso |= bit;
+		}
+	}
+	core->rx = miso;
+}
+
+// Runs after every clock edge. The core shifts tx out and samples rx on the
+// same baud_out edge, so slaves take MOSI just after it and only change MISO
+// on the opposite edge, where nothing samples it.
+static void clockSlaves()
+{
+	uint8_t levels = csPins();
+	uint8_t n, i, count;
+	for (n = 0; n < 4; n++)
+	{
+		if (((levels ^ csLevels) >> n) & 1)
+		{
+			const spiModelSlave* slaves = spiModelGetSlaves(n, &count);
+			for (i = 0; i < count; i++)
+				if (slaves[i].select != nullptr)
+					slaves[i].select(slaves[i].context, !((levels >> n) & 1));
+		}
+	}
+	csLevels = levels;
+
+	uint8_t cs = (control & CS_SELECT_MASK) >> CS_SELECT_OFFSET;
+	uint8_t mode = (control >> (SPI_MODE_OFFSET + (cs << 1))) & SPI_MODE_MASK;
+	bool sampleLevel = !((mode & 1) ^ (mode >> 1));
+	bool level = core->baud_out;
+	if (level != baudLevel && level == sampleLevel)
+	{
+		for (n = 0; n < 4; n++)
+		{
+			if ((csLevels >> n) & 1)
+				continue;
+			const spiModelSlave* slaves = spiModelGetSlaves(n, &count);
+			for (i = 0; i < count; i++)
+			{
+				bool driven;
+				slaves[i].exchange(slaves[i].context, core->tx, 1, &driven);
+			}
+		}
+	}
+	baudLevel = level;
+	if (level != sampleLevel)
+		driveMiso();
+}
+
+static void tick()
+{
+	core->clk = 0;
+	core->eval();
+	context->timeInc(1);
+	core->clk = 1;
+	core->eval();
+	context->timeInc(1);
+	cycles++;
+	clockSlaves();
+}
+
+static void idle()
+{
+	uint32_t i;
+	core->chipselect = 0;
+	core->read = 0;
+	core->write = 0;
+	for (i = 0; i < idleCycles; i++)
+		tick();
+}
+
+static uint32_t cosimRead(uint8_t regOffset)
+{
+	std::lock_guard<std::mutex> guard(cosimLock);
+	core->address = regOffset;
+	core->byteenable = 0x0F;
+	core->chipselect = 1;
+	core->read = 1;
+	// One wait state, readdata is taken at the end of the second cycle
+	tick();
+	uint32_t data = core->readdata;
+	tick();
+	idle();
+	reads++;
+	return data;
+}
+
+static void cosimWrite(uint8_t regOffset, uint32_t data)
+{
+	std::lock_guard<std::mutex> guard(cosimLock);
+	if (regOffset == OFS_CONTROL)
+		control = data;
+	core->address = regOffset;
+	core->byteenable = 0x0F;
+	core->writedata = data;
+	core->chipselect = 1;
+	core->write = 1;
+	tick();
+	idle();
+	writes++;
+}
+
+static uint64_t cosimCycles()
+{
+	std::lock_guard<std::mutex> guard(cosimLock);
+	return cycles;
+}
+
+// Every cycle is a clock edge of the Verilated core
+static bool cosimSimulated()
+{
+	return true;
+}
+
+static void printStats()
+{
+	fprintf(stderr, "cosim: %llu cycles, %llu reads, %llu writes\n", (unsigned long long)cycles,
+		(unsigned long long)reads, (unsigned long long)writes);
+}
+
+static bool cosimOpen()
+{
+	const char* idleText = getenv("SPI_COSIM_IDLE");
+	uint32_t i;
+	if (idleText != nullptr && atoi(idleText) > 1)
+		idleCycles = atoi(idleText);
+	if (!spiModelAttachSlaves())
+		return false;
+
+	context = new VerilatedContext;
+	core = new Vspi{context};
+	core->clk = 0;
+	core->reset = 1;
+	core->read = 0;
+	core->write = 0;
+	core->chipselect = 0;
+	core->rx = 0;
+	for (i = 0; i < RESET_CYCLES; i++)
+		tick();
+	core->reset = 0;
+	tick();
+	cycles = 0;
+
+	if (getenv("SPI_COSIM_STATS") != nullptr)
+		atexit(printStats);
+	return true;
+}
+
+extern "C" const spiBackend spiCosimBackend = { "cosim", cosimOpen, cosimRead, cosimWrite, cosimCycles, cosimSimulated };
@@ -0,0 +1,381 @@
+// SPI IP Module throughput testbench
+// Author: Sarker Nadir Afridi Azmi
+
+// Drives the Avalon slave as fast as polling allows for every word size in
+// control[4:0], a range of brd values and both auto and manual chip select,
+// with a slave model on tx/rx/baud_out. Every word is checked in both
+// directions. One line per run goes to tb_spi_report.csv:
+//   sclk_util       shifting time of an ideal serializer over the time from
+//                   the first SCLK edge to the last one
+//   gap_min/avg     cycles from the last SCLK edge of one word to the first
+//                   edge of the next
+//   cs_setup/hold   cycles from CS falling to the first SCLK edge and from
+//                   the last SCLK edge to CS rising, auto CS only
+//   full_stalls     STATUS polls that found tx_fifo full with words to send
+//   stray_edges     SCLK edges while CS was high, counted as errors
+// The bench only sees the core through its ports: the master polls STATUS
+// and moves DATA over the Avalon slave like software would, and the monitors
+// watch baud_out and cs_0. Reads are held two cycles, writes one, and each
+// access is followed by an idle cycle.
+
+module tb_spi;
+
+	parameter WORDS = 64;
+	parameter BRD_COUNT = 5;
+	parameter TIMEOUT = 200000;
+
+	// Register list
+	parameter DATA_REG 		= 2'b00;
+	parameter STATUS_REG 	= 2'b01;
+	parameter CONTROL_REG 	= 2'b10;
+	parameter BRD_REG		= 2'b11;
+
+	// STATUS bits
+	parameter RXFO = 0;
+	parameter RXFE = 2;
+	parameter TXFO = 3;
+	parameter TXFF = 4;
+
+	reg clk, reset;
+	reg read, write, chipselect;
+	reg [1:0] address;
+	reg [31:0] writedata;
+	wire [31:0] readdata;
+	wire tx, clk_out, baud_out, cs_0, cs_1, cs_2, cs_3, irq;
+	wire [9:0] LEDR;
+	reg rx;
+
+	spi dut
+	(
+		.clk(clk), .reset(reset), .address(address), .byteenable(4'b1111), .chipselect(chipselect),
+		.writedata(writedata), .readdata(readdata), .write(write), .read(read),
+		.tx(tx), .rx(rx), .clk_out(clk_out), .baud_out(baud_out),
+		.cs_0(cs_0), .cs_1(cs_1), .cs_2(cs_2), .cs_3(cs_3), .irq(irq), .LEDR(LEDR)
+	);
+
+	// 50 MHz, one time unit per half cycle
+	initial clk = 1'b0;
+	always #1 clk = !clk;
+
+	// Half SCLK periods, 7 fractional bits like brd
+	reg [31:0] brd_values [0:BRD_COUNT - 1];
+	initial
+	begin
+		brd_values[0] = 32'd128;		// 1.0
+		brd_values[1] = 32'd192;		// 1.5
+		brd_values[2] = 32'd256;		// 2.0
+		brd_values[3] = 32'd512;		// 4.0
+		brd_values[4] = 32'd1280;		// 10.0
+	end
+
+	// Run setup
+	integer word_size;
+	reg [31:0] brd;
+	reg cs_auto;
+	reg measuring;
+
+	function [31:0] mask;
+		input integer bits;
+		mask = (bits == 32) ? 32'hFFFFFFFF : ((32'd1 << bits) - 1);
+	endfunction
+
+	// Words sent by the master and answered by the slave
+	function [31:0] tx_word;
+		input integer k;
+		tx_word = (32'hA5C3_0F96 ^ (k * 32'h9E37_79B9)) & mask(word_size);
+	endfunction
+
+	function [31:0] reply_word;
+		input integer k;
+		reply_word = (32'h3C5A_F00F + (k * 32'h0101_0307)) & mask(word_size);
+	endfunction
+
+	//-----------------------------------------------------------------------------
+	// Slave
+	//-----------------------------------------------------------------------------
+
+	// Mode 0: the core puts tx out and samples rx as baud_out rises, and drops
+	// tx again as it falls. The slave takes tx just before the fall and moves
+	// rx on the fall, so both are stable around the edge the other side uses.
+	reg [31:0] slave_rx [0:WORDS - 1];
+	reg [31:0] slave_shift;
+	integer slave_bit;
+	integer slave_word;
+
+	always @ (negedge cs_0)
+	begin
+		slave_bit = 0;
+		if (slave_word < WORDS)
+			rx <= reply_word(slave_word) >> (word_size - 1);
+	end
+
+	always @ (negedge baud_out)
+	begin
+		if (!cs_0 && measuring)
+		begin
+			slave_shift = { slave_shift[30:0], tx };
+			slave_bit = slave_bit + 1;
+			if (slave_bit == word_size)
+			begin
+				if (slave_word < WORDS)
+					slave_rx[slave_word] = slave_shift & mask(word_size);
+				slave_word = slave_word + 1;
+				slave_bit = 0;
+			end
+			if (slave_word < WORDS)
+				rx <= reply_word(slave_word) >> (word_size - 1 - slave_bit);
+		end
+	end
+
+	//-----------------------------------------------------------------------------
+	// Monitors
+	//-----------------------------------------------------------------------------
+
+	// A word is 2 * word_size SCLK edges with CS low
+	integer cycle;
+	integer edges;
+	integer first_start, last_end;
+	integer gap_sum, gap_count, gap_min;
+	integer cs_fall, last_edge, pending_setup;
+	integer setup_sum, setup_count, hold_sum, hold_count;
+	integer stray_edges;
+	reg last_baud, last_cs;
+
+	always @ (posedge clk)
+	begin
+		cycle = cycle + 1;
+		if (measuring)
+		begin
+			if (baud_out != last_baud)
+			begin
+				if (cs_0)
+					stray_edges = stray_edges + 1;
+				else
+				begin
+					if (edges == 0)
+					begin
+						if (first_start < 0)
+							first_start = cycle;
+						if (last_end >= 0)
+						begin
+							gap_sum = gap_sum + (cycle - last_end);
+							gap_count = gap_count + 1;
+							if (gap_min < 0 || cycle - last_end < gap_min)
+								gap_min = cycle - last_end;
+						end
+					end
+					edges = edges + 1;
+					if (edges == 2 * word_size)
+					begin
+						last_end = cycle;
+						edges = 0;
+					end
+				end
+				if (pending_setup)
+				begin
+					setup_sum = setup_sum + (cycle - cs_fall);
+					setup_count = setup_count + 1;
+					pending_setup = 0;
+				end
+				last_edge = cycle;
+			end
+			if (cs_auto && !cs_0 && last_cs)
+			begin
+				cs_fall = cycle;
+				pending_setup = 1;
+			end
+			if (cs_auto && cs_0 && !last_cs && last_edge >= 0)
+			begin
+				hold_sum = hold_sum + (cycle - last_edge);
+				hold_count = hold_count + 1;
+			end
+		end
+		last_baud = baud_out;
+		last_cs = cs_0;
+	end
+
+	//-----------------------------------------------------------------------------
+	// Avalon master
+	//-----------------------------------------------------------------------------
+
+	task bus_write;
+		input [1:0] offset;
+		input [31:0] data;
+		begin
+			@ (negedge clk);
+			address = offset;
+			writedata = data;
+			chipselect = 1'b1;
+			write = 1'b1;
+			@ (negedge clk);
+			write = 1'b0;
+			chipselect = 1'b0;
+			@ (negedge clk);
+		end
+	endtask
+
+	task bus_read;
+		input [1:0] offset;
+		output [31:0] data;
+		begin
+			@ (negedge clk);
+			address = offset;
+			chipselect = 1'b1;
+			read = 1'b1;
+			// One wait state, readdata is taken at the end of the second cycle
+			@ (negedge clk);
+			data = readdata;
+			@ (negedge clk);
+			read = 1'b0;
+			chipselect = 1'b0;
+			@ (negedge clk);
+		end
+	endtask
+
+	//-----------------------------------------------------------------------------
+	// Runs
+	//-----------------------------------------------------------------------------
+
+	reg [31:0] master_rx [0:WORDS - 1];
+	reg [31:0] data, status;
+	integer sent, received, full_stalls, start_cycle, errors, run_errors, report;
+	integer b, k;
+	real ideal, span, sclk_util, gap_avg, cs_setup, cs_hold;
+
+	task run;
+		begin
+			// Reset empties both FIFOs and the serializer between runs
+			reset = 1'b1;
+			repeat (2) @ (negedge clk);
+			reset = 1'b0;
+			measuring = 1'b0;
+			slave_word = 0;
+			slave_bit = 0;
+			rx = 1'b0;
+			edges = 0;
+			first_start = -1;
+			last_end = -1;
+			gap_sum = 0;
+			gap_count = 0;
+			gap_min = -1;
+			last_edge = -1;
+			pending_setup = 0;
+			setup_sum = 0;
+			setup_count = 0;
+			hold_sum = 0;
+			hold_count = 0;
+			stray_edges = 0;
+			full_stalls = 0;
+			run_errors = 0;
+
+			bus_write(BRD_REG, brd);
+			// CS 0, mode 0, manual CS starts out high
+			bus_write(CONTROL_REG, 32'h8000 | (word_size - 1) | (cs_auto ? 32'h20 : 32'h200));
+			measuring = 1'b1;
+			if (!cs_auto)
+				bus_write(CONTROL_REG, 32'h8000 | (word_size - 1));
+
+			sent = 0;
+			received = 0;
+			start_cycle = cycle;
+			while (received < WORDS && cycle - start_cycle < TIMEOUT)
+			begin
+				// Neither flag can go back on the core's own: it only fills the
+				// RX FIFO and only drains the TX FIFO
+				bus_read(STATUS_REG, status);
+				if (!status[RXFE])
+				begin
+					bus_read(DATA_REG, data);
+					master_rx[received] = data & mask(word_size);
+					received = received + 1;
+				end
+				if (sent < WORDS && !status[TXFF])
+				begin
+					bus_write(DATA_REG, tx_word(sent));
+					sent = sent + 1;
+				end
+				else if (sent < WORDS)
+					full_stalls = full_stalls + 1;
+			end
+			if (!cs_auto)
+				bus_write(CONTROL_REG, 32'h8000 | (word_size - 1) | 32'h200);
+			measuring = 1'b0;
+
+			if (received < WORDS)
+			begin
+				$display("FAIL ws=%0d brd=%0d cs=%s: timed out after %0d of %0d words", word_size, brd,
+					cs_auto ? "auto" : "manual", received, WORDS);
+				run_errors = run_errors + 1;
+			end
+			bus_read(STATUS_REG, status);
+			if (status[RXFO] || status[TXFO])
+			begin
+				$display("FAIL ws=%0d brd=%0d cs=%s: FIFO overflow", word_size, brd, cs_auto ? "auto" : "manual");
+				run_errors = run_errors + 1;
+			end
+			if (stray_edges > 0)
+			begin
+				$display("FAIL ws=%0d brd=%0d cs=%s: %0d SCLK edges with CS high", word_size, brd,
+					cs_auto ? "auto" : "manual", stray_edges);
+				run_errors = run_errors + 1;
+			end
+			for (k = 0; k < received; k = k + 1)
+			begin
+				if (slave_rx[k] !== tx_word(k) || master_rx[k] !== reply_word(k))
+				begin
+					if (run_errors < 4)
+						$display("FAIL ws=%0d brd=%0d cs=%s word %0d: slave got %h want %h, master got %h want %h",
+							word_size, brd, cs_auto ? "auto" : "manual", k, slave_rx[k], tx_word(k), master_rx[k], reply_word(k));
+					run_errors = run_errors + 1;
+				end
+			end
+			errors = errors + run_errors;
+
+			ideal = word_size * 2.0 * brd / 128.0;
+			span = (last_end >= first_start && first_start >= 0) ? last_end - first_start + 1 : 0;
+			sclk_util = span > 0 ? WORDS * ideal / span : 0;
+			gap_avg = gap_count > 0 ? gap_sum * 1.0 / gap_count : 0;
+			cs_setup = setup_count > 0 ? setup_sum * 1.0 / setup_count : 0;
+			cs_hold = hold_count > 0 ? hold_sum * 1.0 / hold_count : 0;
+			$fdisplay(report, "%0d,%0d,%0.3f,%s,%0d,%0d,%0.2f,%0.2f,%0.4f,%0d,%0.2f,%0.2f,%0.2f,%0d,%0d,%0d",
+				word_size, brd, brd / 128.0, cs_auto ? "auto" : "manual", WORDS, span, ideal, span / WORDS, sclk_util,
+				gap_min, gap_avg, cs_setup, cs_hold, full_stalls, stray_edges, run_errors);
+		end
+	endtask
+
+	initial
+	begin
+		read = 1'b0;
+		write = 1'b0;
+		chipselect = 1'b0;
+		address = 2'b00;
+		writedata = 32'b0;
+		reset = 1'b1;
+		measuring = 1'b0;
+		cycle = 0;
+		errors = 0;
+		last_baud = 1'b0;
+		last_cs = 1'b1;
+
+		report = $fopen("tb_spi_report.csv", "w");
+		$fdisplay(report, "word_size,brd,brd_cycles,cs,words,span_cycles,ideal_cycles_per_word,cycles_per_word,sclk_util,gap_min,gap_avg,cs_setup,cs_hold,full_stalls,stray_edges,errors");
+
+		for (word_size = 1; word_size <= 32; word_size = word_size + 1)
+			for (b = 0; b < BRD_COUNT; b = b + 1)
+			begin
+				brd = brd_values[b];
+				cs_auto = 1'b1;
+				run;
+				cs_auto = 1'b0;
+				run;
+			end
+
+		$fclose(report);
+		if (errors == 0)
+			$display("PASS: %0d runs of %0d words, report in tb_spi_report.csv", 32 * BRD_COUNT * 2, WORDS);
+		else
+			$fatal(1, "FAIL: %0d errors, report in tb_spi_report.csv", errors);
+		$finish;
+	end
+
+endmodule
@@ -4,7 +4,7 @@
 module spi
 (
 	clk, reset, address, byteenable, chipselect, writedata, readdata, write, read,
-	tx, rx, clk_out, baud_out, cs_0, cs_1, cs_2, cs_3, LEDR
+	tx, rx, clk_out, baud_out, cs_0, cs_1, cs_2, cs_3, irq, LEDR
 );
 	
 	// Clock, reset
@@ -22,6 +22,9 @@ module spi
 	output wire tx, baud_out, cs_0, cs_1, cs_2, cs_3;
 	input rx;
 	
+	// Interrupt sender, level sensitive
+	output wire irq;
+	
 	output wire [9:0] LEDR;
 	
 	// Register list
@@ -39,6 +42,13 @@ module spi
 	// Only output the clock of the baud rate generator if bit 15 of the control register is set
 	assign enable = control[15];
 	
+	// Interrupt enables
+	// Bit 24 raises irq while the RX FIFO holds data
+	// Bit 25 raises irq once the TX FIFO has been shifted out
+	wire rxne_irq_enable, txfe_irq_enable;
+	assign rxne_irq_enable = control[24];
+	assign txfe_irq_enable = control[25];
+	
 	// Read block
 	always @ (*)
 	begin
@@ -128,6 +138,9 @@ module spi
 	wire [31:0] tx_fifo_data_out, rx_fifo_data_out;
 	wire [3:0] rp, wp;
 	
+	// The line stays asserted until the condition goes away or the enable is cleared
+	assign irq = enable && ((rxne_irq_enable && !rxfe) || (txfe_irq_enable && txfe));
+	
 	// Debug outputs
 	assign LEDR[3:0] = wp;
 	assign LEDR[7:4] = rp;
@@ -324,6 +337,8 @@ module spi
 	// The bcount should be compared against 0 because we want to go to the next
 	// read value after the last bit from the data word is sent
 	assign serializer_read_pulse = ((serializer_state == TX_RX) && bcount == 0);
+	// The last shift edge has been seen, the word is on the wire
+	assign last_bit_done = (bcount == 0) || (decrement && bcount == 1);
 	assign tx = internal_tx;
 	
 	reg internal_tx;
@@ -356,7 +371,10 @@ module spi
 			count <= 32'b0;
 			match <= brd;
 		end
-		else
+		// The serializer only returns to IDLE two cycles after the last shift
+		// edge, so baud_out holds from there on. Another toggle would be an
+		// extra SCLK pulse at fast baud rates.
+		else if(!last_bit_done)
 		begin
 			// Toggle output
 			clk_out <= !clk_out;
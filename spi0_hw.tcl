@@ -126,6 +126,24 @@ set_interface_assignment avalon embeddedsw.configuration.isNonVolatileStorage 0
 set_interface_assignment avalon embeddedsw.configuration.isPrintableDevice 0
 
 
+# 
+# connection point irq
+# 
+add_interface irq interrupt end
+set_interface_property irq associatedAddressablePoint avalon
+set_interface_property irq associatedClock clk
+set_interface_property irq associatedReset reset
+set_interface_property irq bridgedReceiverOffset ""
+set_interface_property irq bridgesToReceiver ""
+set_interface_property irq ENABLED true
+set_interface_property irq EXPORT_OF ""
+set_interface_property irq PORT_NAME_MAP ""
+set_interface_property irq CMSIS_SVD_VARIABLES ""
+set_interface_property irq SVD_ADDRESS_GROUP ""
+
+add_interface_port irq irq irq Output 1
+
+
 # 
 # connection point phy
 # 